@@ -0,0 +1,248 @@
+
+#include "analyzer.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+
+Analyzer::Analyzer()
+: ring_(nullptr)
+, writeIdx_(0)
+, readIdx_(0)
+, dropped_(0)
+, running_(false)
+, fftSize_(0)
+, hop_(0)
+, memory_(nullptr)
+, note_(-1)
+, opCount_(0)
+, rateFactor_(0)
+, building_(nullptr)
+, result_(nullptr)
+{
+}
+
+Analyzer::~Analyzer()
+{
+	stop();
+	free(ring_);
+	free(memory_);
+	delete building_;
+	delete result_;
+}
+
+bool Analyzer::start(int fftSize, int hop)
+{
+	stop();
+	if(fftSize > ANALYZER_MAX_FFT || !plan_.init(fftSize))
+		return false;
+
+	fftSize_ = fftSize;
+	hop_ = hop > 0 && hop <= fftSize ? hop : fftSize/2;
+
+	// Window, frame and transform work, then the history of every stream.
+	const int streams = 3 + ANALYZER_OPS;
+	free(memory_);
+	memory_ = (float*)malloc(sizeof(float) * (fftSize_*(3 + streams) + 2*(fftSize_/2 + 1)));
+	if(ring_ == nullptr)
+		ring_ = (AnalyzerBlock*)malloc(sizeof(AnalyzerBlock) * ANALYZER_RING);
+	if(building_ == nullptr)
+		building_ = new AnalyzerResult();
+	if(result_ == nullptr)
+		result_ = new AnalyzerResult();
+	if(memory_ == nullptr || ring_ == nullptr)
+		return false;
+
+	window_ = memory_;
+	frame_ = window_ + fftSize_;
+	work_ = frame_ + fftSize_;
+	re_ = work_ + fftSize_;
+	im_ = re_ + fftSize_/2 + 1;
+	float* history = im_ + fftSize_/2 + 1;
+	Stream* all[streams] = { &left_, &right_, &mix_ };
+	for(int i = 0; i < ANALYZER_OPS; ++i)
+		all[3 + i] = &ops_[i];
+	for(Stream* s : all) {
+		s->history = history;
+		history += fftSize_;
+		memset(s->history, 0, sizeof(float)*fftSize_);
+		s->pos = 0;
+		s->fresh = 0;
+		s->binHz = 0;
+	}
+
+	// Hann, scaled so a full scale sine on a bin reads 0 dB.
+	double sum = 0;
+	for(int i = 0; i < fftSize_; ++i) {
+		window_[i] = (float)(0.5 - 0.5*cos(2.0*M_PI*i/fftSize_));
+		sum += window_[i];
+	}
+	for(int i = 0; i < fftSize_; ++i)
+		window_[i] = (float)(window_[i] * 2.0/sum);
+
+	note_ = -1;
+	opCount_ = 0;
+	rateFactor_ = 0;
+	*building_ = AnalyzerResult();
+	*result_ = AnalyzerResult();
+	writeIdx_ = 0;
+	readIdx_ = 0;
+	dropped_ = 0;
+	running_ = true;
+	thread_ = std::thread(&Analyzer::run, this);
+	return true;
+}
+
+void Analyzer::stop()
+{
+	running_ = false;
+	if(thread_.joinable())
+		thread_.join();
+}
+
+
+// Single producer, single consumer. Indices only grow, the slot is idx % size.
+AnalyzerBlock* Analyzer::beginWrite()
+{
+	if(!running_.load(std::memory_order_relaxed))
+		return nullptr;
+	const uint32_t w = writeIdx_.load(std::memory_order_relaxed);
+	if(w - readIdx_.load(std::memory_order_acquire) >= ANALYZER_RING) {
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	return &ring_[w % ANALYZER_RING];
+}
+
+void Analyzer::endWrite()
+{
+	writeIdx_.store(writeIdx_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+
+bool Analyzer::latest(AnalyzerResult* out, uint64_t serial)
+{
+	std::lock_guard<std::mutex> lock(resultLock_);
+	if(result_ == nullptr || result_->serial == serial)
+		return false;
+	*out = *result_;
+	return true;
+}
+
+void Analyzer::run()
+{
+	while(running_) {
+		uint32_t r = readIdx_.load(std::memory_order_relaxed);
+		const uint32_t w = writeIdx_.load(std::memory_order_acquire);
+		if(r == w) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			continue;
+		}
+		for(; r != w; ++r) {
+			consume(ring_[r % ANALYZER_RING]);
+			readIdx_.store(r + 1, std::memory_order_release);
+		}
+	}
+}
+
+void Analyzer::push(Stream& s, const float* in, int n)
+{
+	for(int i = 0; i < n; ++i) {
+		s.history[s.pos] = in[i];
+		s.pos = (s.pos + 1) & (fftSize_ - 1);
+	}
+	s.fresh += n;
+}
+
+void Analyzer::consume(const AnalyzerBlock& block)
+{
+	AnalyzerResult& res = *building_;
+	res.blocks++;
+
+	const float rate = 1.f/block.dt;
+	float mono[RENDER_BLOCK];
+	for(int i = 0; i < block.frames; ++i)
+		mono[i] = 0.5f*(block.left[i] + block.right[i]);
+	push(left_, block.left, block.frames);
+	push(right_, block.right, block.frames);
+	push(mix_, mono, block.frames);
+	mix_.binHz = rate / fftSize_;
+
+	// A different voice or rate starts the operator history over.
+	if(block.opFrames > 0) {
+		if(block.note != note_ || block.rateFactor != rateFactor_ || block.opCount != opCount_) {
+			note_ = block.note;
+			rateFactor_ = block.rateFactor;
+			opCount_ = block.opCount;
+			for(Stream& s : ops_) {
+				memset(s.history, 0, sizeof(float)*fftSize_);
+				s.pos = 0;
+				s.fresh = 0;
+			}
+		}
+		for(int i = 0; i < opCount_; ++i) {
+			push(ops_[i], block.ops[i], block.opFrames);
+			ops_[i].binHz = rate / (rateFactor_ * fftSize_);
+		}
+	}
+
+	if(mix_.fresh < hop_)
+		return;
+
+	left_.fresh = right_.fresh = mix_.fresh = 0;
+	double sl = 0, sr = 0;
+	res.peakLeft = res.peakRight = 0;
+	for(int i = 0; i < fftSize_; ++i) {
+		const float l = left_.history[i];
+		const float r = right_.history[i];
+		sl += (double)l*l;
+		sr += (double)r*r;
+		res.peakLeft = fmaxf(res.peakLeft, fabsf(l));
+		res.peakRight = fmaxf(res.peakRight, fabsf(r));
+	}
+	res.rmsLeft = (float)sqrt(sl/fftSize_);
+	res.rmsRight = (float)sqrt(sr/fftSize_);
+	analyze(mix_, &res.mix);
+
+	// Operators are analyzed with the mix, whatever arrived since the last one.
+	res.note = note_;
+	res.opCount = opCount_;
+	for(int i = 0; i < opCount_; ++i) {
+		ops_[i].fresh = 0;
+		analyze(ops_[i], &res.ops[i]);
+	}
+
+	res.serial++;
+	res.dropped = dropped_.load(std::memory_order_relaxed);
+	std::lock_guard<std::mutex> lock(resultLock_);
+	*result_ = res;
+}
+
+// Windowed magnitude spectrum of the last fftSize samples, oldest first.
+void Analyzer::analyze(const Stream& s, AnalyzerSpectrum* out)
+{
+	double energy = 0;
+	float peak = 0;
+	for(int i = 0; i < fftSize_; ++i) {
+		const float v = s.history[(s.pos + i) & (fftSize_ - 1)];
+		frame_[i] = v * window_[i];
+		energy += (double)v*v;
+		peak = fmaxf(peak, fabsf(v));
+	}
+	plan_.forward(frame_, re_, im_, work_);
+
+	const int bins = fftSize_/2 + 1;
+	double weighted = 0, total = 0;
+	for(int k = 0; k < bins; ++k) {
+		const float mag = sqrtf(re_[k]*re_[k] + im_[k]*im_[k]);
+		out->db[k] = 20.f*log10f(mag + 1e-9f);
+		weighted += (double)mag * k;
+		total += mag;
+	}
+	out->bins = bins;
+	out->binHz = s.binHz;
+	out->rms = (float)sqrt(energy/fftSize_);
+	out->peak = peak;
+	out->centroid = total > 0 ? (float)(weighted/total * s.binHz) : 0.f;
+}
@@ -0,0 +1,127 @@
+#if !defined(ANALYZER_H_)
+#define ANALYZER_H_
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "fft.h"
+#include "vulkfm.h"
+
+// Spectrum and level analysis of the synth output for the UI. The audio thread
+// only copies each rendered block into a lock free ring (the tap), a
+// background thread runs the FFTs and meters and publishes the results.
+
+#define ANALYZER_OPS 8					// operators of the tapped voice
+#define ANALYZER_RING 64				// blocks, a full ring drops blocks
+#define ANALYZER_MAX_FFT 4096
+#define ANALYZER_MAX_BINS (ANALYZER_MAX_FFT/2 + 1)
+
+// One rendered block, written by the audio thread.
+struct AnalyzerBlock
+{
+	int frames;
+	float dt;
+	float left[RENDER_BLOCK];		// output 0 after master gain
+	float right[RENDER_BLOCK];
+
+	// Operator outputs of the most recently triggered voice, at the voice's own
+	// rate. opFrames is 0 when the voice didn't render through the block path.
+	int note;
+	int opCount;
+	int opFrames;
+	int rateFactor;
+	float ops[ANALYZER_OPS][RENDER_BLOCK];
+};
+
+struct AnalyzerSpectrum
+{
+	int bins = 0;
+	float binHz = 0;
+	float db[ANALYZER_MAX_BINS];	// magnitude, 0 dB is a full scale sine
+	float rms = 0;
+	float peak = 0;
+	float centroid = 0;				// Hz
+};
+
+struct AnalyzerResult
+{
+	uint64_t serial = 0;			// counts published results
+	uint64_t blocks = 0;			// taken from the tap
+	uint64_t dropped = 0;			// ring was full
+	float rmsLeft = 0, rmsRight = 0;
+	float peakLeft = 0, peakRight = 0;
+	AnalyzerSpectrum mix;			// mono, left and right averaged
+	int note = -1;
+	int opCount = 0;
+	AnalyzerSpectrum ops[ANALYZER_OPS];
+};
+
+
+class Analyzer
+{
+public:
+	Analyzer();
+	~Analyzer();
+	Analyzer(const Analyzer&) = delete;
+	Analyzer& operator=(const Analyzer&) = delete;
+
+	// Start the analysis thread, one result every hop new samples over the
+	// last fftSize. false if fftSize isn't a power of two up to ANALYZER_MAX_FFT.
+	bool start(int fftSize = 2048, int hop = 1024);
+	void stop();
+
+	// Audio thread. A block to fill or nullptr when the ring is full, then
+	// endWrite() to hand it over. Never blocks or allocates.
+	AnalyzerBlock* beginWrite();
+	void endWrite();
+
+	// Copy of the latest result, false if nothing new since serial.
+	bool latest(AnalyzerResult* out, uint64_t serial = 0);
+
+protected:
+	struct Stream
+	{
+		float* history;		// fftSize samples, circular
+		int pos;
+		int fresh;			// samples since the last analysis
+		float binHz;
+	};
+
+	void run();
+	void consume(const AnalyzerBlock& block);
+	void push(Stream& s, const float* in, int n);
+	void analyze(const Stream& s, AnalyzerSpectrum* out);
+
+	AnalyzerBlock* ring_;
+	std::atomic<uint32_t> writeIdx_;
+	std::atomic<uint32_t> readIdx_;
+	std::atomic<uint64_t> dropped_;
+
+	std::thread thread_;
+	std::atomic<bool> running_;
+
+	// Analysis thread only.
+	FftPlan plan_;
+	int fftSize_;
+	int hop_;
+	float* memory_;
+	float* window_;
+	float* frame_;
+	float* work_;
+	float* re_;
+	float* im_;
+	Stream left_;
+	Stream right_;
+	Stream mix_;
+	Stream ops_[ANALYZER_OPS];
+	int note_;
+	int opCount_;
+	int rateFactor_;
+	AnalyzerResult* building_;
+
+	std::mutex resultLock_;
+	AnalyzerResult* result_;
+};
+
+#endif
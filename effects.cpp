@@ -0,0 +1,270 @@
+
+#include "effects.h"
+#include "vulkfm.h"
+
+#include <cstring>
+#include <cmath>
+
+// Reverb line lengths at size 1, seconds. Spread out and without common
+// factors so the echoes don't line up.
+static const float fdnLengths[EFFECT_FDN_LINES] = {
+	0.0297f, 0.0371f, 0.0411f, 0.0437f, 0.0313f, 0.0359f, 0.0397f, 0.0453f,
+};
+
+// Below this a tail is cut off, well before the feedback paths reach denormals.
+#define EFFECT_SILENCE 1e-9f
+
+static int clampi(int v, int lo, int hi) { return v < lo ? lo : (v > hi ? hi : v); }
+static float clampf(float v, float lo, float hi) { return v < lo ? lo : (v > hi ? hi : v); }
+
+static float peak(const float* in, int n)
+{
+	float m = 0;
+	for(int i = 0; i < n; ++i) {
+		const float a = fabsf(in[i]);
+		m = a > m ? a : m;
+	}
+	return m;
+}
+
+
+void EffectLine::read(float* out, int delay, int n) const
+{
+	const int start = (pos - delay) & mask;
+	const int first = n < mask + 1 - start ? n : mask + 1 - start;
+	memcpy(out, buf + start, sizeof(float)*first);
+	memcpy(out + first, buf, sizeof(float)*(n - first));
+}
+
+void EffectLine::write(const float* in, int n)
+{
+	const int first = n < mask + 1 - pos ? n : mask + 1 - pos;
+	memcpy(buf + pos, in, sizeof(float)*first);
+	memcpy(buf, in + first, sizeof(float)*(n - first));
+	pos = (pos + n) & mask;
+}
+
+
+EffectUnit::EffectUnit()
+: memory_(nullptr)
+, floats_(0)
+, type_(EffectNone)
+, phase_(0)
+, quiet_(0)
+, idle_(true)
+{
+	memset(lines_, 0, sizeof(lines_));
+	memset(lowpass_, 0, sizeof(lowpass_));
+}
+
+// Two lines of the longest delay.
+size_t EffectUnit::memoryFloats(float maxRate)
+{
+	size_t line = 1;
+	while(line < (size_t)(EFFECT_MAX_DELAY*maxRate) + RENDER_BLOCK)
+		line <<= 1;
+	return 2*line;
+}
+
+int EffectUnit::scratchFloats()
+{
+	return EFFECT_FDN_LINES*RENDER_BLOCK;
+}
+
+void EffectUnit::init(float* memory, size_t floats)
+{
+	memory_ = memory;
+	floats_ = floats;
+	type_ = EffectNone;
+}
+
+void EffectUnit::reset()
+{
+	setup(type_);
+}
+
+// Split the memory into equal power of two lines for the type.
+void EffectUnit::setup(EEffect type)
+{
+	type_ = type;
+	phase_ = 0;
+	quiet_ = 0;
+	idle_ = true;
+	memset(lowpass_, 0, sizeof(lowpass_));
+	memset(lines_, 0, sizeof(lines_));
+	if(memory_ == nullptr || type == EffectNone)
+		return;
+
+	const int count = type == EffectReverb ? EFFECT_FDN_LINES : 2;
+	size_t length = 1;
+	while(length*2 <= floats_/count)
+		length <<= 1;
+	memset(memory_, 0, sizeof(float)*length*count);
+	for(int i = 0; i < count; ++i) {
+		lines_[i].buf = memory_ + i*length;
+		lines_[i].mask = (int)length - 1;
+		lines_[i].pos = 0;
+	}
+}
+
+void EffectUnit::process(const EffectConf& conf, const float* left, const float* right, float* wetLeft, float* wetRight,
+	int n, float dt, const Kernels& k, float* scratch)
+{
+	if(conf.type != type_)
+		setup(conf.type);
+
+	// An idle unit stays idle until input arrives. Once the output has been
+	// silent for a whole line the lines only hold what is below
+	// EFFECT_SILENCE, the unit goes idle without clearing them. Only a change
+	// of type or a reset pays for clearing the delay memory.
+	const bool silent = fmaxf(peak(left, n), peak(right, n)) < EFFECT_SILENCE;
+	if(silent && idle_) {
+		memset(wetLeft, 0, sizeof(float)*n);
+		memset(wetRight, 0, sizeof(float)*n);
+		return;
+	}
+	idle_ = false;
+
+	switch(type_) {
+	case EffectDelay:	processDelay(conf, left, right, wetLeft, wetRight, n, dt, k, scratch); break;
+	case EffectChorus:	processChorus(conf, left, right, wetLeft, wetRight, n, dt, k, scratch); break;
+	case EffectReverb:	processReverb(conf, left, right, wetLeft, wetRight, n, dt, k, scratch); break;
+	default:
+		memset(wetLeft, 0, sizeof(float)*n);
+		memset(wetRight, 0, sizeof(float)*n);
+		break;
+	}
+
+	if(!silent || fmaxf(peak(wetLeft, n), peak(wetRight, n)) >= EFFECT_SILENCE)
+		quiet_ = 0;
+	else if((quiet_ += n) > lines_[0].mask + 1) {
+		quiet_ = 0;
+		idle_ = true;
+		memset(lowpass_, 0, sizeof(lowpass_));
+	}
+}
+
+// The delayed block is the output, its lowpassed copy times feedback goes back
+// in with the input. Delays shorter than a block would read what this block
+// hasn't written yet, so RENDER_BLOCK is the minimum.
+void EffectUnit::processDelay(const EffectConf& conf, const float* left, const float* right, float* wetLeft, float* wetRight,
+	int n, float dt, const Kernels& k, float* scratch)
+{
+	const int delay = clampi((int)(conf.time/dt + 0.5f), RENDER_BLOCK, lines_[0].mask + 1 - RENDER_BLOCK);
+	const float feedback = clampf(conf.feedback, -0.98f, 0.98f);
+	const float a = 1.f - clampf(conf.damping, 0.f, 0.99f);
+	const float* in[2] = { left, right };
+	float* wet[2] = { wetLeft, wetRight };
+
+	for(int c = 0; c < 2; ++c) {
+		lines_[c].read(wet[c], delay, n);
+		float lp = lowpass_[c];
+		for(int i = 0; i < n; ++i) {
+			lp += a*(wet[c][i] - lp);
+			scratch[i] = lp;
+		}
+		lowpass_[c] = lp;
+		k.scale(scratch, feedback, n);
+		k.addScaled(scratch, in[c], 1.f, n);
+		lines_[c].write(scratch, n);
+	}
+}
+
+// The lfo is evaluated at the block ends and ramped in between, it is far
+// below the block rate. Left and right are a quarter cycle apart. The delay
+// moves at most one sample per sample, so the taps of a block sweep at most
+// 2n samples. That span is read in one go, the taps are gathered from it
+// without wrapping and interpolated by the lerp kernel.
+void EffectUnit::processChorus(const EffectConf& conf, const float* left, const float* right, float* wetLeft, float* wetRight,
+	int n, float dt, const Kernels& k, float* scratch)
+{
+	lines_[0].write(left, n);
+	lines_[1].write(right, n);
+
+	const float maxDelay = (float)(lines_[0].mask - RENDER_BLOCK);
+	const float center = conf.center/dt;
+	const float swing = conf.depth/dt;
+	const float phaseEnd = phase_ + conf.rate*dt*n;
+	float* span = scratch;
+	float* next = scratch + 3*RENDER_BLOCK;
+	float* frac = scratch + 4*RENDER_BLOCK;
+	float* wet[2] = { wetLeft, wetRight };
+
+	for(int c = 0; c < 2; ++c) {
+		const float offset = c*0.25f;
+		const float d0 = clampf(center + swing*sinf(2.f*(float)M_PI*(phase_ + offset)), 1.f, maxDelay);
+		const float d1 = clampf(clampf(center + swing*sinf(2.f*(float)M_PI*(phaseEnd + offset)), 1.f, maxDelay), d0 - n, d0 + n);
+		const float step = (d1 - d0)/n;
+
+		// Sample i is d0 + step*i + n-1-i samples older than the last one
+		// written, i * (1 - step) - d0 - n relative to the write position.
+		const float first = -d0 - (float)n;
+		const float last = first + (n - 1)*(1.f - step);
+		const float lo = floorf(first < last ? first : last);
+		const float hi = first < last ? last : first;
+		// One more sample than the taps need in case rounding puts the last one
+		// just past hi.
+		lines_[c].read(span, -(int)lo, (int)(hi - lo) + 3);
+		for(int i = 0; i < n; ++i) {
+			const float x = first - lo + i*(1.f - step);
+			const int j = (int)x;
+			wet[c][i] = span[j];
+			next[i] = span[j + 1];
+			frac[i] = x - j;
+		}
+		k.lerp(wet[c], wet[c], next, frac, n);
+	}
+	phase_ = phaseEnd - floorf(phaseEnd);
+}
+
+// Feedback delay network: every line's output is damped, scaled for the decay
+// time and mixed into all lines through a normalized 8x8 Hadamard matrix.
+// Even lines take and give the left channel, odd lines the right.
+void EffectUnit::processReverb(const EffectConf& conf, const float* left, const float* right, float* wetLeft, float* wetRight,
+	int n, float dt, const Kernels& k, float* scratch)
+{
+	const float a = 1.f - clampf(conf.damping, 0.f, 0.99f);
+	const float decay = conf.decay > 0.01f ? conf.decay : 0.01f;
+	float* x[EFFECT_FDN_LINES];
+
+	for(int j = 0; j < EFFECT_FDN_LINES; ++j) {
+		x[j] = scratch + j*RENDER_BLOCK;
+		const int length = clampi((int)(conf.size*fdnLengths[j]/dt), RENDER_BLOCK, lines_[j].mask + 1 - RENDER_BLOCK);
+		lines_[j].read(x[j], length, n);
+
+		float lp = lowpass_[j];
+		for(int i = 0; i < n; ++i) {
+			lp += a*(x[j][i] - lp);
+			x[j][i] = lp;
+		}
+		lowpass_[j] = lp;
+
+		// Gain for -60 dB after decay seconds, with the matrix normalization.
+		const float gain = powf(10.f, -3.f*length*dt/decay) * 0.35355339f;
+		k.scale(x[j], gain, n);
+	}
+
+	memset(wetLeft, 0, sizeof(float)*n);
+	memset(wetRight, 0, sizeof(float)*n);
+	for(int j = 0; j < EFFECT_FDN_LINES; ++j)
+		k.addScaled(j & 1 ? wetRight : wetLeft, x[j], 1.f, n);
+
+	for(int h = 1; h < EFFECT_FDN_LINES; h <<= 1) {
+		for(int j = 0; j < EFFECT_FDN_LINES; ++j) {
+			if(j & h)
+				continue;
+			float* p = x[j];
+			float* q = x[j + h];
+			for(int i = 0; i < n; ++i) {
+				const float s = p[i] + q[i];
+				q[i] = p[i] - q[i];
+				p[i] = s;
+			}
+		}
+	}
+
+	for(int j = 0; j < EFFECT_FDN_LINES; ++j) {
+		k.addScaled(x[j], j & 1 ? right : left, 0.5f, n);
+		lines_[j].write(x[j], n);
+	}
+}
@@ -0,0 +1,103 @@
+#if !defined(EFFECTS_H_)
+#define EFFECTS_H_
+
+#include <cstddef>
+
+struct Kernels;
+
+// Effects run on mixed bus blocks, once per block after the voices. A unit is
+// either an insert on one bus, processed in place, or a send that any number
+// of buses feed and whose return is added to an output.
+//
+// Delay memory of every unit is allocated up front, sized for
+// EFFECT_MAX_DELAY seconds at VulkFMConfig::effectMaxRate. Lines are power of
+// two rings read and written a block at a time, so the block arithmetic is on
+// contiguous buffers. Cost per block of n frames, stereo:
+//   delay   2 block reads and writes, 2 serial one pole lowpasses, ~8 flops/frame
+//   chorus  1 block write, 1 block read of the span the taps sweep, a gather
+//           of 2 taps per frame and the lerp kernel, ~6 flops/frame
+//   reverb  8 line reads and writes, 8x8 Hadamard (24 adds) and 8 one poles
+//           per frame, ~60 flops/frame
+// A unit without input whose tail has died away idles at no cost.
+
+#define EFFECT_MAX_DELAY 2.f		// seconds
+#define EFFECT_FDN_LINES 8
+
+enum EEffect
+{
+	EffectNone,
+	EffectDelay,		// stereo feedback delay
+	EffectChorus,		// two modulated delays, quadrature lfo
+	EffectReverb,		// 8 line feedback delay network
+};
+
+enum EEffectRouting
+{
+	EffectInsert,
+	EffectSend,
+};
+
+struct EffectConf
+{
+	EEffect type = EffectNone;
+	float mix = 0.3f;			// wet level, an insert keeps 1 - mix of the dry signal
+	int output = 0;				// where a send returns to
+
+	float time = 0.35f;			// delay time, seconds
+	float feedback = 0.4f;		// delay
+	float damping = 0.3f;		// 0..1, lowpass in the delay and reverb feedback
+	float center = 0.02f;		// chorus center delay, seconds
+	float rate = 0.8f;			// chorus lfo, Hz
+	float depth = 0.002f;		// chorus delay swing, seconds
+	float size = 1.f;			// reverb room scale, 1 is around 35 ms lines
+	float decay = 1.8f;			// reverb RT60, seconds
+};
+
+
+// A power of two ring of samples.
+struct EffectLine
+{
+	float* buf;
+	int mask;
+	int pos;			// next write
+
+	// n samples starting delay samples before the write position.
+	void read(float* out, int delay, int n) const;
+	void write(const float* in, int n);
+};
+
+
+class EffectUnit
+{
+public:
+	EffectUnit();
+
+	// Floats of delay memory for one unit.
+	static size_t memoryFloats(float maxRate);
+	void init(float* memory, size_t floats);
+
+	// Wet signal of n frames into wetLeft/wetRight, before mix. scratch holds
+	// scratchFloats() floats. A change of type clears the delay memory.
+	void process(const EffectConf& conf, const float* left, const float* right, float* wetLeft, float* wetRight,
+		int n, float dt, const Kernels& k, float* scratch);
+	static int scratchFloats();
+
+	void reset();
+
+protected:
+	void setup(EEffect type);
+	void processDelay(const EffectConf& conf, const float* left, const float* right, float* wetLeft, float* wetRight, int n, float dt, const Kernels& k, float* scratch);
+	void processChorus(const EffectConf& conf, const float* left, const float* right, float* wetLeft, float* wetRight, int n, float dt, const Kernels& k, float* scratch);
+	void processReverb(const EffectConf& conf, const float* left, const float* right, float* wetLeft, float* wetRight, int n, float dt, const Kernels& k, float* scratch);
+
+	float* memory_;
+	size_t floats_;
+	EEffect type_;
+	EffectLine lines_[EFFECT_FDN_LINES];
+	float lowpass_[EFFECT_FDN_LINES];	// damping filter state per line
+	float phase_;						// chorus lfo, 0..1
+	int quiet_;							// frames of silent output
+	bool idle_;							// lines are clear
+};
+
+#endif
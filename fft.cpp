@@ -0,0 +1,113 @@
+
+#include "fft.h"
+
+#include <cstdlib>
+#include <cmath>
+
+FftPlan::FftPlan()
+: size_(0)
+, half_(0)
+, cos_(nullptr)
+, sin_(nullptr)
+, splitCos_(nullptr)
+, splitSin_(nullptr)
+, bitrev_(nullptr)
+{
+}
+
+FftPlan::~FftPlan()
+{
+	free(cos_);
+	free(bitrev_);
+}
+
+bool FftPlan::init(int size)
+{
+	if(size < 4 || (size & (size-1)) != 0)
+		return false;
+
+	free(cos_);
+	free(bitrev_);
+	size_ = size;
+	half_ = size/2;
+
+	// One allocation for the four twiddle tables.
+	cos_ = (float*)malloc(sizeof(float) * 3*half_);
+	bitrev_ = (int*)malloc(sizeof(int) * half_);
+	if(cos_ == nullptr || bitrev_ == nullptr) {
+		free(cos_);
+		free(bitrev_);
+		cos_ = nullptr;
+		bitrev_ = nullptr;
+		size_ = half_ = 0;
+		return false;
+	}
+	sin_ = cos_ + half_/2;
+	splitCos_ = sin_ + half_/2;
+	splitSin_ = splitCos_ + half_;
+
+	for(int i = 0; i < half_/2; ++i) {
+		cos_[i] = (float)cos(2.0*M_PI*i/half_);
+		sin_[i] = (float)-sin(2.0*M_PI*i/half_);
+	}
+	for(int i = 0; i < half_; ++i) {
+		splitCos_[i] = (float)cos(2.0*M_PI*i/size_);
+		splitSin_[i] = (float)-sin(2.0*M_PI*i/size_);
+	}
+
+	int bits = 0;
+	while((1 << bits) < half_)
+		++bits;
+	for(int i = 0; i < half_; ++i) {
+		int r = 0;
+		for(int b = 0; b < bits; ++b)
+			r |= ((i >> b) & 1) << (bits-1-b);
+		bitrev_[i] = r;
+	}
+	return true;
+}
+
+// Even and odd samples packed as one complex signal of half the size, then
+// split into the spectrum of the real signal.
+void FftPlan::forward(const float* in, float* re, float* im, float* work) const
+{
+	float* zr = work;
+	float* zi = work + half_;
+	for(int i = 0; i < half_; ++i) {
+		const int r = bitrev_[i];
+		zr[r] = in[2*i];
+		zi[r] = in[2*i + 1];
+	}
+
+	for(int len = 2; len <= half_; len <<= 1) {
+		const int step = half_/len;
+		for(int start = 0; start < half_; start += len) {
+			for(int j = 0; j < len/2; ++j) {
+				const float wr = cos_[j*step];
+				const float wi = sin_[j*step];
+				const int a = start + j;
+				const int b = a + len/2;
+				const float tr = zr[b]*wr - zi[b]*wi;
+				const float ti = zr[b]*wi + zi[b]*wr;
+				zr[b] = zr[a] - tr;
+				zi[b] = zi[a] - ti;
+				zr[a] += tr;
+				zi[a] += ti;
+			}
+		}
+	}
+
+	re[0] = zr[0] + zi[0];
+	im[0] = 0.f;
+	re[half_] = zr[0] - zi[0];
+	im[half_] = 0.f;
+	for(int k = 1; k < half_; ++k) {
+		const int m = half_ - k;
+		const float er = 0.5f*(zr[k] + zr[m]);
+		const float ei = 0.5f*(zi[k] - zi[m]);
+		const float or_ = 0.5f*(zi[k] + zi[m]);
+		const float oi = -0.5f*(zr[k] - zr[m]);
+		re[k] = er + or_*splitCos_[k] - oi*splitSin_[k];
+		im[k] = ei + or_*splitSin_[k] + oi*splitCos_[k];
+	}
+}
@@ -0,0 +1,32 @@
+#if !defined(FFT_H_)
+#define FFT_H_
+
+// Radix 2 FFT of real signals. The plan holds the twiddles and the bit reversal
+// table for one size so a transform allocates nothing.
+class FftPlan
+{
+public:
+	FftPlan();
+	~FftPlan();
+	FftPlan(const FftPlan&) = delete;
+	FftPlan& operator=(const FftPlan&) = delete;
+
+	// size is a power of two >= 4. false if it isn't or memory ran out.
+	bool init(int size);
+	int size() const { return size_; }
+
+	// Spectrum of size real samples, re and im hold size/2 + 1 bins. in is not
+	// changed, work holds size floats.
+	void forward(const float* in, float* re, float* im, float* work) const;
+
+protected:
+	int size_;
+	int half_;			// complex transform size
+	float* cos_;		// half_/2 twiddles of the complex transform
+	float* sin_;
+	float* splitCos_;	// half_ twiddles to split the packed result
+	float* splitSin_;
+	int* bitrev_;
+};
+
+#endif
@@ -0,0 +1,408 @@
+
+#include "golden.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+
+#define GOLDEN_MAGIC "VFG1"
+
+struct NoteScript
+{
+	int frame;
+	int8_t note;
+	bool on;
+	int8_t channel = 0;	// bus of the same number
+};
+
+struct GoldenCase
+{
+	const char* name;
+	void (*setup)(Instrument* inst);
+	const NoteScript* script;
+	int scriptLength;
+	void (*setupMix)(VulkFM& synth) = nullptr;
+	void (*change)(Instrument* inst) = nullptr;	// patch change at changeFrame
+	int changeFrame = 0;
+};
+
+
+static void setupDx7(Instrument* inst)
+{
+	inst->setAlgorithm(&dx7_1Algo);
+	inst->opConf_[1].freqScale = 2.0f;
+	inst->opConf_[3].freqScale = 3.5f;
+	inst->opConf_[5].oscAmp = 0.6f;
+}
+
+static void setupFourOp(Instrument* inst)
+{
+	inst->setAlgorithm(&defaultAlgorithm);
+	inst->opConf_[1].oscWaveform = AbsSine;
+	inst->opConf_[2].oscWaveform = ClampSine;
+	inst->opConf_[3].oscWaveform = Square;		// unmodulated, edges land on the same sample in every mode
+	inst->opConf_[3].freqScale = 0.5f;
+	inst->opConf_[3].oscAmp = 0.8f;
+}
+
+static void setupGraph8(Instrument* inst)
+{
+	OpGraph graph;
+	graph.operatorCount = 8;
+	for(int i = 0; i < 8; i += 2) {
+		graph.connect(i+1, i, 1.5f);
+		graph.outs[i] = true;
+		inst->opConf_[i+1].freqScale = 1.0f + i;
+	}
+	graph.connect(7, 7, 0.4f);
+	graph.connect(3, 0, 0.5f);
+	inst->setGraph(graph);
+}
+
+static void setupCyclic(Instrument* inst)
+{
+	OpGraph graph;
+	graph.operatorCount = 3;
+	graph.connect(1, 0);
+	graph.connect(2, 1, 0.7f);
+	graph.connect(0, 2, 0.3f);	// closes the loop, renders per sample
+	graph.outs[0] = true;
+	inst->opConf_[1].freqScale = 2.0f;
+	inst->setGraph(graph);
+}
+
+static void setupShortEnv(Instrument* inst)
+{
+	inst->setAlgorithm(&dx7_1Algo);
+	for(int i = 0; i < 6; ++i) {
+		inst->opConf_[i].env.attack = 0.005f;
+		inst->opConf_[i].env.decay = 0.05f;
+		inst->opConf_[i].env.release = 0.03f;
+	}
+}
+
+static void setupUnison(Instrument* inst)
+{
+	setupDx7(inst);
+	inst->unison = 7;		// odd count, exercises the scalar lane tail
+	inst->unisonDetune = 25.f;
+	inst->unisonPhaseSpread = 0.5f;
+}
+
+static void setupPanned(Instrument* inst)
+{
+	setupFourOp(inst);
+	inst->gain = 1.4f;
+	inst->pan = -0.6f;		// mono is the average of both sides, level drops off center
+	inst->velocitySens = 0.8f;
+}
+
+static void setupRepeat(Instrument* inst)
+{
+	setupShortEnv(inst);	// voices end quickly so repeated notes get new voices
+	inst->unison = 3;
+	inst->unisonDetune = 12.f;
+}
+
+// Sines only, low enough for reduced rate on most notes.
+static void setupBass(Instrument* inst)
+{
+	OpGraph graph;
+	graph.operatorCount = 3;
+	graph.connect(1, 0, 1.2f);
+	graph.outs[0] = true;
+	graph.outs[2] = true;
+	inst->opConf_[1].freqScale = 2.0f;
+	inst->opConf_[2].freqScale = 0.5f;
+	inst->opConf_[2].oscAmp = 0.5f;
+	inst->setGraph(graph);
+}
+
+// Two more operators than the held notes were triggered with.
+static void changeToDx7(Instrument* inst)
+{
+	inst->setAlgorithm(&dx7_1Algo);
+}
+
+// Chorus insert on bus 0, delay insert on bus 1, bus 0 and 2 send to a
+// reverb. The render runs past the last note so the tails are covered.
+static void mixEffects(VulkFM& synth)
+{
+	EffectConf* chorus = synth.getEffect(0);
+	chorus->type = EffectChorus;
+	chorus->mix = 0.5f;
+	EffectConf* delay = synth.getEffect(1);
+	delay->type = EffectDelay;
+	delay->time = 0.05f;
+	delay->feedback = 0.6f;
+	EffectConf* reverb = synth.getEffect(2);
+	reverb->type = EffectReverb;
+	reverb->size = 0.5f;
+	reverb->decay = 0.8f;
+
+	synth.getBus(0)->effect = 0;
+	synth.getBus(1)->effect = 1;
+	synth.getBus(2)->effect = 2;
+	synth.getBus(2)->effectRouting = EffectSend;
+	synth.getBus(2)->effectSend = 0.7f;
+}
+
+// 5-limit just major scale on the white keys at A 440, black keys left out
+// and don't play.
+static void tuneJust(VulkFM& synth)
+{
+	static const char scale[] =
+		"! just.scl\n5-limit major\n 7\n9/8\n5/4\n4/3\n3/2\n5/3\n15/8\n2/1\n";
+	static const char map[] =
+		"! white.kbm\n12\n0\n127\n48\n57\n440.0\n7\n0\nx\n1\nx\n2\n3\nx\n4\nx\n5\nx\n6\n";
+	synth.getTuning()->loadScala(scale, sizeof(scale) - 1);
+	synth.getTuning()->loadKeyboardMap(map, sizeof(map) - 1);
+}
+
+
+static const NoteScript chordScript[] = {
+	{ 0, 48, true }, { 0, 52, true }, { 0, 55, true },
+	{ 5000, 60, true },
+	{ 9000, 48, false }, { 9000, 52, false }, { 9000, 55, false },
+	{ 12000, 60, false },
+};
+
+static const NoteScript runScript[] = {
+	{ 0, 40, true }, { 1500, 40, false },
+	{ 2000, 47, true }, { 3500, 47, false },
+	{ 3700, 52, true }, { 4100, 52, true },	// retrigger while held
+	{ 6000, 52, false },
+	{ 6001, 59, true }, { 9000, 64, true },
+	{ 11000, 59, false }, { 11000, 64, false },
+};
+
+static const NoteScript staccatoScript[] = {
+	{ 0, 57, true }, { 700, 57, false },
+	{ 1800, 60, true }, { 2500, 60, false },
+	{ 2600, 57, true }, { 2601, 64, true },
+	{ 3300, 57, false }, { 3300, 64, false },
+	{ 6000, 69, true }, { 6700, 69, false },
+	{ 6800, 45, true }, { 7500, 45, false },
+};
+
+// Repeated notes for the note cache: hits released part way into the
+// recording, held past its end and a recording cut short by a retrigger.
+static const NoteScript repeatScript[] = {
+	{ 0, 60, true }, { 2000, 60, false },
+	{ 4000, 60, true }, { 4900, 60, false },
+	{ 6500, 60, true }, { 6500, 67, true },
+	{ 7000, 67, true }, { 7600, 67, false },
+	{ 9500, 67, true }, { 10500, 67, false },
+	{ 11000, 60, false },
+};
+
+static const NoteScript effectScript[] = {
+	{ 0, 48, true, 0 }, { 0, 55, true, 2 },
+	{ 1500, 64, true, 1 }, { 2200, 64, false, 1 },
+	{ 4000, 48, false, 0 }, { 4000, 55, false, 2 },
+	{ 4500, 67, true, 1 }, { 5000, 67, false, 1 },
+};
+
+// Black key 61 is out of the map, 45 is below the mapped octave.
+static const NoteScript justScript[] = {
+	{ 0, 57, true }, { 0, 61, true },
+	{ 3000, 64, true }, { 3000, 45, true },
+	{ 7000, 57, false }, { 7000, 61, false },
+	{ 9000, 60, true }, { 12000, 64, false }, { 12000, 45, false },
+	{ 13000, 60, false },
+};
+
+#define SCRIPT(s) s, (int)(sizeof(s)/sizeof(s[0]))
+
+static const GoldenCase cases[] = {
+	{ "dx7_chord",		setupDx7,		SCRIPT(chordScript) },
+	{ "four_op_run",	setupFourOp,	SCRIPT(runScript) },
+	{ "graph8_chord",	setupGraph8,	SCRIPT(chordScript) },
+	{ "cyclic_run",		setupCyclic,	SCRIPT(runScript) },
+	{ "short_env",		setupShortEnv,	SCRIPT(staccatoScript) },
+	{ "unison_chord",	setupUnison,	SCRIPT(chordScript) },
+	{ "panned_run",		setupPanned,	SCRIPT(runScript) },
+	{ "repeat_notes",	setupRepeat,	SCRIPT(repeatScript) },
+	{ "bass_run",		setupBass,		SCRIPT(runScript) },
+	{ "effects",		setupShortEnv,	SCRIPT(effectScript), mixEffects },
+	{ "just_run",		setupUnison,	SCRIPT(justScript), tuneJust },
+	{ "algo_change",	setupFourOp,	SCRIPT(chordScript), nullptr, changeToDx7, 3000 },	// held notes keep their program
+};
+
+static const int caseCount = sizeof(cases)/sizeof(cases[0]);
+
+
+int goldenCaseCount() { return caseCount; }
+
+const char* goldenCaseName(int idx) { return cases[idx].name; }
+
+void renderGoldenCase(int idx, ERenderMode mode, EKernelLevel level, float* out, bool noteCache, bool adaptiveRate)
+{
+	const GoldenCase& c = cases[idx];
+	const float dt = 1.f/GOLDEN_RATE;
+
+	VulkFMConfig config;
+	config.noteCacheBytes = noteCache ? 4<<20 : 0;
+	config.effects = 3;
+	config.effectMaxRate = GOLDEN_RATE;
+	VulkFM synth(config);
+	synth.setRenderMode(mode);
+	synth.setKernels(level);
+	synth.setAdaptiveRate(adaptiveRate);
+	c.setup(synth.getInstrument(0));
+	if(c.setupMix)
+		c.setupMix(synth);
+
+	// Odd chunk size so blocks are split at awkward places.
+	const int chunk = 97;
+	int frame = 0;
+	int ev = 0;
+	bool changed = c.change == nullptr;
+	while(frame < GOLDEN_FRAMES) {
+		if(!changed && frame >= c.changeFrame) {
+			c.change(synth.getInstrument(0));
+			changed = true;
+		}
+		while(ev < c.scriptLength && c.script[ev].frame <= frame) {
+			const NoteScript& n = c.script[ev++];
+			if(n.on)
+				synth.trigger(n.note, n.channel, 100);
+			else
+				synth.release(n.note, n.channel, 0);
+			synth.processEvents();
+		}
+
+		int run = GOLDEN_FRAMES - frame;
+		if(run > chunk)
+			run = chunk;
+		if(ev < c.scriptLength && c.script[ev].frame - frame < run)
+			run = c.script[ev].frame - frame;
+		if(!changed && c.changeFrame - frame < run)
+			run = c.changeFrame - frame;
+
+		synth.render(out + frame, run, dt);
+		frame += run;
+	}
+}
+
+
+static void goldenPath(char* path, size_t size, const char* dir, int idx)
+{
+	snprintf(path, size, "%s/%s.f32", dir, cases[idx].name);
+}
+
+bool writeGoldens(const char* dir)
+{
+	float* out = (float*)malloc(sizeof(float)*GOLDEN_FRAMES);
+	bool ok = true;
+
+	for(int i = 0; i < caseCount && ok; ++i) {
+		renderGoldenCase(i, RenderReference, KernelScalar, out);
+
+		char path[512];
+		goldenPath(path, sizeof(path), dir, i);
+		FILE* f = fopen(path, "wb");
+		if(f == nullptr) {
+			printf("could not write %s\n", path);
+			ok = false;
+			break;
+		}
+		uint32_t frames = GOLDEN_FRAMES;
+		ok = fwrite(GOLDEN_MAGIC, 1, 4, f) == 4
+			&& fwrite(&frames, sizeof(frames), 1, f) == 1
+			&& fwrite(out, sizeof(float), GOLDEN_FRAMES, f) == GOLDEN_FRAMES;
+		fclose(f);
+		printf("wrote %s\n", path);
+	}
+
+	free(out);
+	return ok;
+}
+
+static bool readGolden(const char* dir, int idx, float* out)
+{
+	char path[512];
+	goldenPath(path, sizeof(path), dir, idx);
+	FILE* f = fopen(path, "rb");
+	if(f == nullptr)
+		return false;
+
+	char magic[4];
+	uint32_t frames = 0;
+	bool ok = fread(magic, 1, 4, f) == 4 && memcmp(magic, GOLDEN_MAGIC, 4) == 0
+		&& fread(&frames, sizeof(frames), 1, f) == 1 && frames == GOLDEN_FRAMES
+		&& fread(out, sizeof(float), GOLDEN_FRAMES, f) == GOLDEN_FRAMES;
+	fclose(f);
+	return ok;
+}
+
+
+static GoldenResult compare(const float* golden, const float* out, const GoldenTolerance& tol)
+{
+	GoldenResult r;
+	double signal = 0, noise = 0;
+	r.maxError = 0;
+	for(int i = 0; i < GOLDEN_FRAMES; ++i) {
+		double e = fabs((double)out[i] - golden[i]);
+		if(e > r.maxError || e != e)
+			r.maxError = e;
+		signal += (double)golden[i]*golden[i];
+		noise += e*e;
+	}
+	r.snr = noise > 0 ? 10.0*log10(signal/noise) : INFINITY;
+	r.pass = r.maxError <= tol.maxError && r.snr >= tol.minSnr;
+	r.seconds = 0;
+	return r;
+}
+
+int checkGoldens(const char* dir)
+{
+	// Reference is the exact path the goldens come from, only libm differences
+	// between platforms are allowed. Block kernels use a polynomial sine.
+	// Adaptive rate is bounded by the upsampler image rejection.
+	struct Mode { const char* name; ERenderMode mode; EKernelLevel level; GoldenTolerance tol; bool cache; bool adaptive; };
+	const Mode modes[] = {
+		{ "reference",		RenderReference,	KernelScalar,	{ 1e-5f, 110.f }, false, false },
+		{ "block/scalar",	RenderBlock,		KernelScalar,	{ 1e-4f, 90.f }, false, false },
+		{ "block/sse2",		RenderBlock,		KernelSSE2,		{ 1e-4f, 90.f }, false, false },
+		{ "block/avx2",		RenderBlock,		KernelAVX2,		{ 1e-4f, 90.f }, false, false },
+		{ "block/avx512",	RenderBlock,		KernelAVX512,	{ 1e-4f, 90.f }, false, false },
+		{ "block/cached",	RenderBlock,		KernelBest,		{ 1e-4f, 90.f }, true, false },
+		{ "adaptive",		RenderBlock,		KernelBest,		{ 2e-3f, 50.f }, false, true },
+		{ "adaptive/cache",	RenderBlock,		KernelBest,		{ 2e-3f, 50.f }, true, true },
+	};
+
+	float* golden = (float*)malloc(sizeof(float)*GOLDEN_FRAMES);
+	float* out = (float*)malloc(sizeof(float)*GOLDEN_FRAMES);
+	int failures = 0;
+
+	printf("%-14s %-14s %12s %9s %9s\n", "case", "mode", "max error", "snr dB", "ms");
+	for(int i = 0; i < caseCount; ++i) {
+		if(!readGolden(dir, i, golden)) {
+			printf("%-14s missing or bad golden file\n", cases[i].name);
+			failures++;
+			continue;
+		}
+
+		for(const Mode& m : modes) {
+			if(m.mode == RenderBlock && getKernels(m.level) == nullptr)
+				continue;
+
+			auto start = std::chrono::steady_clock::now();
+			renderGoldenCase(i, m.mode, m.level, out, m.cache, m.adaptive);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			GoldenResult r = compare(golden, out, m.tol);
+			r.seconds = elapsed.count();
+			printf("%-14s %-14s %12.3g %9.1f %9.2f %s\n", cases[i].name, m.name, r.maxError, r.snr, r.seconds*1000.0, r.pass ? "ok" : "FAIL");
+			if(!r.pass)
+				failures++;
+		}
+	}
+
+	free(golden);
+	free(out);
+	return failures;
+}
@@ -0,0 +1,42 @@
+#if !defined(GOLDEN_H_)
+#define GOLDEN_H_
+
+#include "vulkfm.h"
+
+// Golden output regression. A fixed set of patches and note scripts is rendered
+// in reference mode and stored, every engine mode is then compared against the
+// stored output with its own tolerance.
+
+#define GOLDEN_RATE 44100
+#define GOLDEN_FRAMES 16384
+
+struct GoldenTolerance
+{
+	float maxError;		// max abs difference per sample
+	float minSnr;		// dB, signal is the golden output
+};
+
+struct GoldenResult
+{
+	double maxError;
+	double snr;
+	double seconds;		// render time
+	bool pass;
+};
+
+int goldenCaseCount();
+const char* goldenCaseName(int idx);
+
+// Render case idx, out holds GOLDEN_FRAMES samples. level only matters for
+// RenderBlock, noteCache turns on the note render cache and adaptiveRate
+// lets low voices render below the output rate.
+void renderGoldenCase(int idx, ERenderMode mode, EKernelLevel level, float* out, bool noteCache = false, bool adaptiveRate = false);
+
+// Write reference renders of all cases to dir. Returns false on io error.
+bool writeGoldens(const char* dir);
+
+// Compare all cases in every mode this cpu supports, prints a table. Returns
+// number of failures.
+int checkGoldens(const char* dir);
+
+#endif
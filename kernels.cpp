@@ -0,0 +1,73 @@
+
+#include "kernels.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define KERNELS_X86
+#endif
+
+extern const Kernels kernelsScalar;
+#if defined(KERNELS_X86)
+extern const Kernels kernelsSSE2;
+extern const Kernels kernelsAVX2;
+extern const Kernels kernelsAVX512;
+#endif
+
+static const char* levelNames[KernelLevelCount] = { "scalar", "sse2", "avx2", "avx512" };
+
+const char* kernelLevelName(EKernelLevel level)
+{
+	return level < KernelLevelCount ? levelNames[level] : "best";
+}
+
+static bool cpuSupports(EKernelLevel level)
+{
+#if defined(KERNELS_X86)
+	__builtin_cpu_init();
+	switch(level) {
+	case KernelScalar:	return true;
+	case KernelSSE2:	return __builtin_cpu_supports("sse2");
+	case KernelAVX2:	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	case KernelAVX512:	return __builtin_cpu_supports("avx512f");
+	default:			return false;
+	}
+#else
+	return level == KernelScalar;
+#endif
+}
+
+static const Kernels* table(EKernelLevel level)
+{
+	switch(level) {
+	case KernelScalar:	return &kernelsScalar;
+#if defined(KERNELS_X86)
+	case KernelSSE2:	return &kernelsSSE2;
+	case KernelAVX2:	return &kernelsAVX2;
+	case KernelAVX512:	return &kernelsAVX512;
+#endif
+	default:			return nullptr;
+	}
+}
+
+const Kernels* getKernels(EKernelLevel level)
+{
+	if(level < KernelLevelCount)
+		return cpuSupports(level) ? table(level) : nullptr;
+
+	int maxLevel = KernelLevelCount-1;
+	const char* cap = getenv("VULKFM_KERNELS");
+	if(cap != nullptr) {
+		for(int i = 0; i < KernelLevelCount; ++i) {
+			if(strcmp(cap, levelNames[i]) == 0)
+				maxLevel = i;
+		}
+	}
+
+	for(int i = maxLevel; i > KernelScalar; --i) {
+		if(cpuSupports((EKernelLevel)i) && table((EKernelLevel)i) != nullptr)
+			return table((EKernelLevel)i);
+	}
+	return &kernelsScalar;
+}
@@ -0,0 +1,67 @@
+#if !defined(KERNELS_H_)
+#define KERNELS_H_
+
+// Inner loops of the block renderer. The same code is compiled once per
+// instruction set (kernels_impl.h) and the best table for the running cpu is
+// picked at startup.
+
+enum EKernelLevel
+{
+	KernelScalar,
+	KernelSSE2,
+	KernelAVX2,
+	KernelAVX512,
+	KernelLevelCount,
+	KernelBest = KernelLevelCount,
+};
+
+struct Kernels
+{
+	const char* name;
+	EKernelLevel level;
+	int width;		// floats per vector
+
+	// out = env * amp * wave(phase + mod)
+	void (*osc)(float* out, const float* phase, const float* mod, const float* env, float amp, int waveform, int n);
+
+	// Same with the operator modulating itself, fbDepth * previous output is added
+	// to the phase. Serial by nature. *last holds the previous output in and out.
+	void (*oscFeedback)(float* out, const float* phase, const float* mod, const float* env, float amp, int waveform, float fbDepth, float* last, int n);
+
+	// Unison stack, lanes copies of one operator at different pitch and phase.
+	// out and mod are sample major, out[s*lanes + l]. phase, inc and last
+	// (previous output, for self-feedback) hold one value per lane and are
+	// updated. The envelope is shared by all lanes.
+	void (*oscLanes)(float* out, float* phase, const float* inc, const float* mod, const float* env, float amp, int waveform, float fbDepth, float* last, int lanes, int n);
+
+	// out[s] += gain * sum of in[s*lanes .. s*lanes + lanes-1]
+	void (*sumLanes)(float* out, const float* in, float gain, int lanes, int n);
+
+	// dst += src * gain
+	void (*addScaled)(float* dst, const float* src, float gain, int n);
+
+	// dst *= gain
+	void (*scale)(float* dst, float gain, int n);
+
+	// left += src * gainLeft, right += src * gainRight
+	void (*panAdd)(float* left, float* right, const float* src, float gainLeft, float gainRight, int n);
+
+	// out = a + frac * (b - a), out may be a
+	void (*lerp)(float* out, const float* a, const float* b, const float* frac, int n);
+
+	// dst = clamp(dst * gain, -limit, limit)
+	void (*gainLimit)(float* dst, float gain, float limit, int n);
+
+	// out[i] = sum of coeffs[j] * in[i-j], j < taps. in[-taps+1 .. -1] must be valid.
+	void (*fir)(float* out, const float* in, const float* coeffs, int taps, int n);
+};
+
+
+// Table for a level, nullptr if not built in or not supported by this cpu.
+// KernelBest gives the best supported level, VULKFM_KERNELS=scalar|sse2|avx2|avx512
+// in the environment caps it.
+const Kernels* getKernels(EKernelLevel level = KernelBest);
+
+const char* kernelLevelName(EKernelLevel level);
+
+#endif
@@ -0,0 +1,29 @@
+// AVX2 + FMA kernels, 8 lanes. Built with -mavx2 -mfma, only called when the
+// cpu reports both.
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+
+typedef __m256 vfloat;
+#define VLEN 8
+
+static inline vfloat v_load(const float* p)					{ return _mm256_loadu_ps(p); }
+static inline void v_store(float* p, vfloat v)					{ _mm256_storeu_ps(p, v); }
+static inline vfloat v_set1(float v)							{ return _mm256_set1_ps(v); }
+static inline vfloat v_add(vfloat a, vfloat b)					{ return _mm256_add_ps(a, b); }
+static inline vfloat v_sub(vfloat a, vfloat b)					{ return _mm256_sub_ps(a, b); }
+static inline vfloat v_mul(vfloat a, vfloat b)					{ return _mm256_mul_ps(a, b); }
+static inline vfloat v_madd(vfloat a, vfloat b, vfloat c)		{ return _mm256_fmadd_ps(a, b, c); }
+static inline vfloat v_min(vfloat a, vfloat b)					{ return _mm256_min_ps(a, b); }
+static inline vfloat v_max(vfloat a, vfloat b)					{ return _mm256_max_ps(a, b); }
+static inline vfloat v_abs(vfloat a)							{ return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+static inline vfloat v_round(vfloat a)							{ return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC); }
+static inline vfloat v_signxor(vfloat a, vfloat b)				{ return _mm256_xor_ps(a, _mm256_and_ps(b, _mm256_set1_ps(-0.f))); }
+static inline vfloat v_gtsel(vfloat a, vfloat b, vfloat x, vfloat y) { return _mm256_blendv_ps(y, x, _mm256_cmp_ps(a, b, _CMP_GT_OQ)); }
+
+#define KERNEL_TABLE	kernelsAVX2
+#define KERNEL_NAME		"avx2"
+#define KERNEL_LEVEL	KernelAVX2
+#include "kernels_impl.h"
+
+#endif
@@ -0,0 +1,33 @@
+// AVX-512F kernels, 16 lanes. Built with -mavx512f, only called when the cpu
+// reports it.
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+
+typedef __m512 vfloat;
+#define VLEN 16
+
+static inline vfloat v_load(const float* p)					{ return _mm512_loadu_ps(p); }
+static inline void v_store(float* p, vfloat v)					{ _mm512_storeu_ps(p, v); }
+static inline vfloat v_set1(float v)							{ return _mm512_set1_ps(v); }
+static inline vfloat v_add(vfloat a, vfloat b)					{ return _mm512_add_ps(a, b); }
+static inline vfloat v_sub(vfloat a, vfloat b)					{ return _mm512_sub_ps(a, b); }
+static inline vfloat v_mul(vfloat a, vfloat b)					{ return _mm512_mul_ps(a, b); }
+static inline vfloat v_madd(vfloat a, vfloat b, vfloat c)		{ return _mm512_fmadd_ps(a, b, c); }
+static inline vfloat v_min(vfloat a, vfloat b)					{ return _mm512_min_ps(a, b); }
+static inline vfloat v_max(vfloat a, vfloat b)					{ return _mm512_max_ps(a, b); }
+static inline vfloat v_abs(vfloat a)							{ return _mm512_abs_ps(a); }
+static inline vfloat v_round(vfloat a)							{ return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC); }
+static inline vfloat v_signxor(vfloat a, vfloat b)
+{
+	__m512i sign = _mm512_and_si512(_mm512_castps_si512(b), _mm512_set1_epi32((int)0x80000000u));
+	return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), sign));
+}
+static inline vfloat v_gtsel(vfloat a, vfloat b, vfloat x, vfloat y) { return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_GT_OQ), y, x); }
+
+#define KERNEL_TABLE	kernelsAVX512
+#define KERNEL_NAME		"avx512"
+#define KERNEL_LEVEL	KernelAVX512
+#include "kernels_impl.h"
+
+#endif
@@ -0,0 +1,273 @@
+// Kernel bodies shared by all instruction sets. Not a normal header, it is
+// included once at the end of each kernels_<isa>.cpp after that file has
+// defined the vector type and helpers:
+//
+//   vfloat, VLEN, v_load, v_store, v_set1, v_add, v_sub, v_mul, v_madd (a*b+c),
+//   v_min, v_max, v_abs, v_round, v_signxor (flip sign of a where b is negative),
+//   v_gtsel (a > b ? x : y)
+//
+// and KERNEL_TABLE, KERNEL_NAME and KERNEL_LEVEL. Everything here is static so
+// code built for one instruction set can never be picked up by another.
+
+#include "kernels.h"
+
+#define K_PI		3.14159265358979f
+#define K_TAU_HI	6.28318548202514648f	// float(2*pi)
+#define K_TAU_LO	-1.7484555e-7f			// 2*pi - K_TAU_HI
+#define K_INV_TAU	0.159154943091895f
+
+// Taylor series to x^11 on [0, pi/2], max error around 6e-8
+#define K_S3	-1.66666667e-1f
+#define K_S5	 8.33333333e-3f
+#define K_S7	-1.98412698e-4f
+#define K_S9	 2.75573192e-6f
+#define K_S11	-2.50521084e-8f
+
+enum { KSine, KSquare, KClampSine, KAbsSine };	// same order as EWaveForm
+
+
+// Scalar versions, used for tails and the serial feedback loop.
+
+static inline float s_sin(float x)
+{
+	float k = (float)(int)(x*K_INV_TAU + (x >= 0 ? 0.5f : -0.5f));
+	x = x - k*K_TAU_HI - k*K_TAU_LO;
+	float ax = x < 0 ? -x : x;
+	float y = ax < K_PI-ax ? ax : K_PI-ax;
+	float y2 = y*y;
+	float s = y + y*y2*(K_S3 + y2*(K_S5 + y2*(K_S7 + y2*(K_S9 + y2*K_S11))));
+	return x < 0 ? -s : s;
+}
+
+static inline float s_wave(float a, int waveform)
+{
+	switch(waveform) {
+	case KSine:			return s_sin(a);
+	case KAbsSine:		{ float s = s_sin(a); return s < 0 ? -s : s; }
+	case KClampSine:	{ float s = s_sin(a); return s < 0 ? 0.f : (s > 1.f ? 1.f : s); }
+	case KSquare:		return a > K_PI ? -1.f : 1.f;
+	default:			return 0.f;
+	}
+}
+
+
+static inline vfloat v_sin(vfloat x)
+{
+	vfloat k = v_round(v_mul(x, v_set1(K_INV_TAU)));
+	x = v_madd(k, v_set1(-K_TAU_HI), x);
+	x = v_madd(k, v_set1(-K_TAU_LO), x);
+	vfloat ax = v_abs(x);
+	vfloat y = v_min(ax, v_sub(v_set1(K_PI), ax));
+	vfloat y2 = v_mul(y, y);
+	vfloat p = v_madd(y2, v_set1(K_S11), v_set1(K_S9));
+	p = v_madd(y2, p, v_set1(K_S7));
+	p = v_madd(y2, p, v_set1(K_S5));
+	p = v_madd(y2, p, v_set1(K_S3));
+	vfloat s = v_madd(v_mul(y, y2), p, y);
+	return v_signxor(s, x);
+}
+
+template<int W>
+static inline vfloat v_wave(vfloat a)
+{
+	switch(W) {
+	case KSine:			return v_sin(a);
+	case KAbsSine:		return v_abs(v_sin(a));
+	case KClampSine:	return v_min(v_max(v_sin(a), v_set1(0.f)), v_set1(1.f));
+	case KSquare:		return v_gtsel(a, v_set1(K_PI), v_set1(-1.f), v_set1(1.f));
+	default:			return v_set1(0.f);
+	}
+}
+
+
+template<int W>
+static void osc_loop(float* out, const float* phase, const float* mod, const float* env, float amp, int n)
+{
+	const vfloat vamp = v_set1(amp);
+	int i = 0;
+	for(; i + VLEN <= n; i += VLEN) {
+		vfloat w = v_wave<W>(v_add(v_load(phase+i), v_load(mod+i)));
+		v_store(out+i, v_mul(v_mul(w, vamp), v_load(env+i)));
+	}
+	for(; i < n; ++i)
+		out[i] = s_wave(phase[i]+mod[i], W) * amp * env[i];
+}
+
+static void k_osc(float* out, const float* phase, const float* mod, const float* env, float amp, int waveform, int n)
+{
+	switch(waveform) {
+	case KSine:			osc_loop<KSine>(out, phase, mod, env, amp, n); break;
+	case KSquare:		osc_loop<KSquare>(out, phase, mod, env, amp, n); break;
+	case KClampSine:	osc_loop<KClampSine>(out, phase, mod, env, amp, n); break;
+	case KAbsSine:		osc_loop<KAbsSine>(out, phase, mod, env, amp, n); break;
+	default:
+		for(int i = 0; i < n; ++i) out[i] = 0.f;
+		break;
+	}
+}
+
+static void k_oscFeedback(float* out, const float* phase, const float* mod, const float* env, float amp, int waveform, float fbDepth, float* last, int n)
+{
+	float prev = *last;
+	for(int i = 0; i < n; ++i) {
+		prev = s_wave(phase[i] + mod[i] + prev*fbDepth, waveform) * amp * env[i];
+		out[i] = prev;
+	}
+	*last = prev;
+}
+
+template<int W>
+static void osc_lanes(float* out, float* phase, const float* inc, const float* mod, const float* env, float amp, float fbDepth, float* last, int lanes, int n)
+{
+	const vfloat vamp = v_set1(amp);
+	const vfloat vfb = v_set1(fbDepth);
+	const vfloat tau = v_set1(K_TAU_HI);
+	int l = 0;
+	for(; l + VLEN <= lanes; l += VLEN) {
+		vfloat p = v_load(phase+l);
+		vfloat dp = v_load(inc+l);
+		vfloat prev = v_load(last+l);
+		for(int s = 0; s < n; ++s) {
+			vfloat a = v_madd(prev, vfb, v_add(p, v_load(mod + s*lanes + l)));
+			prev = v_mul(v_mul(v_wave<W>(a), vamp), v_set1(env[s]));
+			v_store(out + s*lanes + l, prev);
+			p = v_add(p, dp);
+			p = v_gtsel(p, tau, v_sub(p, tau), p);
+		}
+		v_store(phase+l, p);
+		v_store(last+l, prev);
+	}
+	for(; l < lanes; ++l) {
+		float p = phase[l];
+		float prev = last[l];
+		for(int s = 0; s < n; ++s) {
+			prev = s_wave(p + mod[s*lanes + l] + prev*fbDepth, W) * amp * env[s];
+			out[s*lanes + l] = prev;
+			p += inc[l];
+			if(p > K_TAU_HI)
+				p -= K_TAU_HI;
+		}
+		phase[l] = p;
+		last[l] = prev;
+	}
+}
+
+static void k_oscLanes(float* out, float* phase, const float* inc, const float* mod, const float* env, float amp, int waveform, float fbDepth, float* last, int lanes, int n)
+{
+	switch(waveform) {
+	case KSine:			osc_lanes<KSine>(out, phase, inc, mod, env, amp, fbDepth, last, lanes, n); break;
+	case KSquare:		osc_lanes<KSquare>(out, phase, inc, mod, env, amp, fbDepth, last, lanes, n); break;
+	case KClampSine:	osc_lanes<KClampSine>(out, phase, inc, mod, env, amp, fbDepth, last, lanes, n); break;
+	case KAbsSine:		osc_lanes<KAbsSine>(out, phase, inc, mod, env, amp, fbDepth, last, lanes, n); break;
+	default:
+		for(int i = 0; i < n*lanes; ++i) out[i] = 0.f;
+		break;
+	}
+}
+
+static void k_sumLanes(float* out, const float* in, float gain, int lanes, int n)
+{
+	for(int s = 0; s < n; ++s) {
+		const float* x = in + s*lanes;
+		float sum = 0.f;
+		for(int l = 0; l < lanes; ++l)
+			sum += x[l];
+		out[s] += sum*gain;
+	}
+}
+
+static void k_addScaled(float* dst, const float* src, float gain, int n)
+{
+	const vfloat g = v_set1(gain);
+	int i = 0;
+	for(; i + VLEN <= n; i += VLEN)
+		v_store(dst+i, v_madd(v_load(src+i), g, v_load(dst+i)));
+	for(; i < n; ++i)
+		dst[i] += src[i]*gain;
+}
+
+static void k_panAdd(float* left, float* right, const float* src, float gainLeft, float gainRight, int n)
+{
+	const vfloat gl = v_set1(gainLeft);
+	const vfloat gr = v_set1(gainRight);
+	int i = 0;
+	for(; i + VLEN <= n; i += VLEN) {
+		vfloat x = v_load(src+i);
+		v_store(left+i, v_madd(x, gl, v_load(left+i)));
+		v_store(right+i, v_madd(x, gr, v_load(right+i)));
+	}
+	for(; i < n; ++i) {
+		left[i] += src[i]*gainLeft;
+		right[i] += src[i]*gainRight;
+	}
+}
+
+static void k_lerp(float* out, const float* a, const float* b, const float* frac, int n)
+{
+	int i = 0;
+	for(; i + VLEN <= n; i += VLEN) {
+		vfloat x = v_load(a+i);
+		v_store(out+i, v_madd(v_sub(v_load(b+i), x), v_load(frac+i), x));
+	}
+	for(; i < n; ++i)
+		out[i] = a[i] + frac[i]*(b[i] - a[i]);
+}
+
+static void k_fir(float* out, const float* in, const float* coeffs, int taps, int n)
+{
+	int i = 0;
+	for(; i + VLEN <= n; i += VLEN) {
+		vfloat acc = v_mul(v_load(in+i), v_set1(coeffs[0]));
+		for(int j = 1; j < taps; ++j)
+			acc = v_madd(v_load(in+i-j), v_set1(coeffs[j]), acc);
+		v_store(out+i, acc);
+	}
+	for(; i < n; ++i) {
+		float acc = in[i]*coeffs[0];
+		for(int j = 1; j < taps; ++j)
+			acc += in[i-j]*coeffs[j];
+		out[i] = acc;
+	}
+}
+
+static void k_gainLimit(float* dst, float gain, float limit, int n)
+{
+	const vfloat g = v_set1(gain);
+	const vfloat hi = v_set1(limit);
+	const vfloat lo = v_set1(-limit);
+	int i = 0;
+	for(; i + VLEN <= n; i += VLEN)
+		v_store(dst+i, v_max(v_min(v_mul(v_load(dst+i), g), hi), lo));
+	for(; i < n; ++i) {
+		float s = dst[i]*gain;
+		dst[i] = s > limit ? limit : (s < -limit ? -limit : s);
+	}
+}
+
+static void k_scale(float* dst, float gain, int n)
+{
+	const vfloat g = v_set1(gain);
+	int i = 0;
+	for(; i + VLEN <= n; i += VLEN)
+		v_store(dst+i, v_mul(v_load(dst+i), g));
+	for(; i < n; ++i)
+		dst[i] *= gain;
+}
+
+
+extern const Kernels KERNEL_TABLE;
+const Kernels KERNEL_TABLE = {
+	KERNEL_NAME,
+	KERNEL_LEVEL,
+	VLEN,
+	k_osc,
+	k_oscFeedback,
+	k_oscLanes,
+	k_sumLanes,
+	k_addScaled,
+	k_scale,
+	k_panAdd,
+	k_lerp,
+	k_gainLimit,
+	k_fir,
+};
@@ -0,0 +1,23 @@
+// Plain C++ kernels, always built and the fallback on any cpu.
+
+typedef float vfloat;
+#define VLEN 1
+
+static inline vfloat v_load(const float* p)					{ return *p; }
+static inline void v_store(float* p, vfloat v)					{ *p = v; }
+static inline vfloat v_set1(float v)							{ return v; }
+static inline vfloat v_add(vfloat a, vfloat b)					{ return a+b; }
+static inline vfloat v_sub(vfloat a, vfloat b)					{ return a-b; }
+static inline vfloat v_mul(vfloat a, vfloat b)					{ return a*b; }
+static inline vfloat v_madd(vfloat a, vfloat b, vfloat c)		{ return a*b+c; }
+static inline vfloat v_min(vfloat a, vfloat b)					{ return a<b?a:b; }
+static inline vfloat v_max(vfloat a, vfloat b)					{ return a>b?a:b; }
+static inline vfloat v_abs(vfloat a)							{ return a<0?-a:a; }
+static inline vfloat v_round(vfloat a)							{ return (float)(int)(a + (a >= 0 ? 0.5f : -0.5f)); }
+static inline vfloat v_signxor(vfloat a, vfloat b)				{ return b<0?-a:a; }
+static inline vfloat v_gtsel(vfloat a, vfloat b, vfloat x, vfloat y) { return a>b?x:y; }
+
+#define KERNEL_TABLE	kernelsScalar
+#define KERNEL_NAME		"scalar"
+#define KERNEL_LEVEL	KernelScalar
+#include "kernels_impl.h"
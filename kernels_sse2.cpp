@@ -0,0 +1,32 @@
+// SSE2 kernels, 4 lanes.
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+typedef __m128 vfloat;
+#define VLEN 4
+
+static inline vfloat v_load(const float* p)					{ return _mm_loadu_ps(p); }
+static inline void v_store(float* p, vfloat v)					{ _mm_storeu_ps(p, v); }
+static inline vfloat v_set1(float v)							{ return _mm_set1_ps(v); }
+static inline vfloat v_add(vfloat a, vfloat b)					{ return _mm_add_ps(a, b); }
+static inline vfloat v_sub(vfloat a, vfloat b)					{ return _mm_sub_ps(a, b); }
+static inline vfloat v_mul(vfloat a, vfloat b)					{ return _mm_mul_ps(a, b); }
+static inline vfloat v_madd(vfloat a, vfloat b, vfloat c)		{ return _mm_add_ps(_mm_mul_ps(a, b), c); }
+static inline vfloat v_min(vfloat a, vfloat b)					{ return _mm_min_ps(a, b); }
+static inline vfloat v_max(vfloat a, vfloat b)					{ return _mm_max_ps(a, b); }
+static inline vfloat v_abs(vfloat a)							{ return _mm_andnot_ps(_mm_set1_ps(-0.f), a); }
+static inline vfloat v_round(vfloat a)							{ return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }
+static inline vfloat v_signxor(vfloat a, vfloat b)				{ return _mm_xor_ps(a, _mm_and_ps(b, _mm_set1_ps(-0.f))); }
+static inline vfloat v_gtsel(vfloat a, vfloat b, vfloat x, vfloat y)
+{
+	__m128 m = _mm_cmpgt_ps(a, b);
+	return _mm_or_ps(_mm_and_ps(m, x), _mm_andnot_ps(m, y));
+}
+
+#define KERNEL_TABLE	kernelsSSE2
+#define KERNEL_NAME		"sse2"
+#define KERNEL_LEVEL	KernelSSE2
+#include "kernels_impl.h"
+
+#endif
@@ -0,0 +1,138 @@
+
+#include "latency.h"
+
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+
+static uint64_t nowNs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+LatencyProbe::LatencyProbe(int capacity)
+: records_((LatencyRecord*)malloc(sizeof(LatencyRecord) * capacity))
+, capacity_(records_ != nullptr ? capacity : 0)
+, count_(0)
+, undelivered_(0)
+{
+}
+
+LatencyProbe::~LatencyProbe()
+{
+	free(records_);
+}
+
+int LatencyProbe::begin(int note, uint64_t frame)
+{
+	const int id = count_.load(std::memory_order_relaxed);
+	if(id >= capacity_)
+		return -1;
+
+	LatencyRecord& r = records_[id];
+	r.note = note;
+	r.abandoned = false;
+	for(int s = 0; s < LatencyStampCount; ++s)
+		r.ns[s] = r.frame[s] = LATENCY_UNSET;
+	r.ns[LatencyCall] = nowNs();
+	r.frame[LatencyCall] = frame;
+	count_.store(id + 1, std::memory_order_release);
+	return id;
+}
+
+void LatencyProbe::stamp(int id, ELatencyStamp which, uint64_t frame)
+{
+	if(id < 0)
+		return;
+	records_[id].ns[which] = nowNs();
+	records_[id].frame[which] = frame;
+}
+
+void LatencyProbe::abandon(int id)
+{
+	if(id >= 0)
+		records_[id].abandoned = true;
+}
+
+void LatencyProbe::delivered(uint64_t frameEnd)
+{
+	const int count = count_.load(std::memory_order_acquire);
+	const uint64_t now = nowNs();
+	bool leading = true;
+	for(int id = undelivered_; id < count; ++id) {
+		LatencyRecord& r = records_[id];
+		if(r.ns[LatencyDelivered] == LATENCY_UNSET && !r.abandoned) {
+			if(r.frame[LatencyFirst] == LATENCY_UNSET || r.frame[LatencyFirst] >= frameEnd) {
+				leading = false;
+				continue;
+			}
+			r.ns[LatencyDelivered] = now;
+			r.frame[LatencyDelivered] = frameEnd;
+		}
+		if(leading)
+			undelivered_ = id + 1;
+	}
+}
+
+
+// min, percentiles, max, mean and standard deviation of n values, sorted in place.
+static void printStats(FILE* out, const char* name, double* v, int n, const char* format)
+{
+	if(n == 0) {
+		fprintf(out, "%-10s %6d\n", name, 0);
+		return;
+	}
+	std::sort(v, v + n);
+	double sum = 0, sq = 0;
+	for(int i = 0; i < n; ++i) {
+		sum += v[i];
+		sq += v[i]*v[i];
+	}
+	const double mean = sum/n;
+	const double var = sq/n - mean*mean;
+	const double stats[] = { v[0], v[n/2], v[(int)(n*0.9)], v[(int)(n*0.99)], v[n-1], mean, var > 0 ? sqrt(var) : 0.0 };
+	fprintf(out, "%-10s %6d", name, n);
+	for(double s : stats)
+		fprintf(out, format, s);
+	fprintf(out, "\n");
+}
+
+void LatencyProbe::report(FILE* out) const
+{
+	static const char* stageNames[] = { "queue", "render", "output", "total" };
+	static const int stageFrom[] = { LatencyCall, LatencyHandled, LatencyFirst, LatencyCall };
+	static const int stageTo[] = { LatencyHandled, LatencyFirst, LatencyDelivered, LatencyDelivered };
+
+	const int count = this->count();
+	double* values = (double*)malloc(sizeof(double) * (count > 0 ? count : 1));
+	if(values == nullptr)
+		return;
+
+	int abandoned = 0, complete = 0;
+	for(int id = 0; id < count; ++id) {
+		abandoned += records_[id].abandoned;
+		complete += records_[id].ns[LatencyDelivered] != LATENCY_UNSET;
+	}
+	fprintf(out, "note-on latency: %d triggers, %d delivered, %d never sounded\n", count, complete, abandoned);
+
+	for(int unit = 0; unit < 2; ++unit) {
+		fprintf(out, "%-10s %6s %9s %9s %9s %9s %9s %9s %9s\n", unit == 0 ? "stage ms" : "frames",
+			"count", "min", "p50", "p90", "p99", "max", "mean", "jitter");
+		for(int s = 0; s < 4; ++s) {
+			int n = 0;
+			for(int id = 0; id < count; ++id) {
+				const LatencyRecord& r = records_[id];
+				if(r.ns[stageFrom[s]] == LATENCY_UNSET || r.ns[stageTo[s]] == LATENCY_UNSET)
+					continue;
+				values[n++] = unit == 0
+					? (double)(int64_t)(r.ns[stageTo[s]] - r.ns[stageFrom[s]]) * 1e-6
+					: (double)(int64_t)(r.frame[stageTo[s]] - r.frame[stageFrom[s]]);
+			}
+			printStats(out, stageNames[s], values, n, unit == 0 ? " %9.3f" : " %9.1f");
+		}
+	}
+	free(values);
+}
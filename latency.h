@@ -0,0 +1,69 @@
+#if !defined(LATENCY_H_)
+#define LATENCY_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+
+// Note-on latency measurement. Every trigger() gets a record stamped at four
+// points, with wall clock time and with the output frame count:
+//   call       trigger() was called
+//   handled    the event was taken off the queue at the start of a render
+//   first      the voice produced its first non-silent sample
+//   delivered  the buffer holding that sample was handed to the device
+// Stages between them are reported as distributions, jitter is the standard
+// deviation. Records are preallocated, stamping never allocates or locks.
+
+#define LATENCY_UNSET UINT64_MAX
+
+struct LatencyRecord
+{
+	int note;
+	bool abandoned;		// voice never sounded, no free voice or silent patch
+	uint64_t ns[4];		// per stage, LATENCY_UNSET until reached
+	uint64_t frame[4];
+};
+
+enum ELatencyStamp
+{
+	LatencyCall,
+	LatencyHandled,
+	LatencyFirst,
+	LatencyDelivered,
+	LatencyStampCount,
+};
+
+class LatencyProbe
+{
+public:
+	explicit LatencyProbe(int capacity = 4096);
+	~LatencyProbe();
+	LatencyProbe(const LatencyProbe&) = delete;
+	LatencyProbe& operator=(const LatencyProbe&) = delete;
+
+	// Thread calling trigger(). Record id, -1 when full.
+	int begin(int note, uint64_t frame);
+
+	// Render thread.
+	void stamp(int id, ELatencyStamp which, uint64_t frame);
+	void abandon(int id);
+
+	// Render thread, after the frames before frameEnd were handed to the
+	// device. Stamps every record whose first sample is among them.
+	void delivered(uint64_t frameEnd);
+
+	int count() const { return count_.load(std::memory_order_acquire); }
+	const LatencyRecord& record(int id) const { return records_[id]; }
+
+	// Distributions per stage, in ms and in frames. Call when nothing is
+	// rendering anymore.
+	void report(FILE* out) const;
+
+protected:
+	LatencyRecord* records_;
+	int capacity_;
+	std::atomic<int> count_;
+	int undelivered_;		// render thread, oldest record not delivered or abandoned
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include <SDL2/SDL.h>
 #endif
 #include <cstdio>
+#include <cstdlib>
 #include <cstdint>
 #include <cstring>
 #include <cmath>
@@ -15,6 +16,9 @@
 #include "imgui_impl_sdl_gl3.h"
 #include <GL/gl3w.h>
 #include "vulkfm.h"
+#include "midi.h"
+#include "analyzer.h"
+#include "latency.h"
 
 
 static long timesamples[10];
@@ -22,6 +26,14 @@ static int time_sample_idx = 0;
 static int time_sample_count = 10;
 
 static float sampTime;
+static int audioChannels = 1;
+
+// Set when a midi file is given on the command line, owned by audio thread once playing.
+static MidiPlayer* midiPlayer = nullptr;
+
+// Note-on latency measurement, on with VULKFM_LATENCY=1. Reported at exit.
+// SDL_AUDIODRIVER=dummy measures without a sound card.
+static LatencyProbe* latencyProbe = nullptr;
 
 static void audio_fill_buffer_s16(void* userdata, Uint8* stream, int len)
 {
@@ -32,15 +44,45 @@ static void audio_fill_buffer_s16(void* userdata, Uint8* stream, int len)
 
 	auto start_time = std::chrono::high_resolution_clock::now();
 
-	for(int i = 0; i < samples;++i)
+	// Stereo uses output 0 of the synth, mono gets it mixed down.
+	float block[2][256];
+	float* outs[2] = { block[0], block[1] };
+	const int channels = audioChannels;
+	while(samples > 0)
 	{
-		float sample = synth->evaluate();
-		synth->update(sampTime);
-		// Clip instead of overflow
-		//sample = sample<-1.f?-1.f:(sample>1.f?1.f:sample);
-		*buff++ = (int16_t)(sample*(32768>>1));
+		int count = samples/channels < 256 ? samples/channels : 256;
+
+		// Once the song is over the player renders nothing, the synth keeps
+		// playing so the keyboard still works.
+		int rendered = 0;
+		if(channels == 2)
+		{
+			if(midiPlayer)
+				rendered = midiPlayer->renderOutputs(outs, count);
+			float* rest[2] = { block[0] + rendered, block[1] + rendered };
+			if(rendered < count)
+				synth->renderOutputs(rest, count - rendered, sampTime);
+		}
+		else
+		{
+			if(midiPlayer)
+				rendered = midiPlayer->render(block[0], count);
+			if(rendered < count)
+				synth->render(block[0] + rendered, count - rendered, sampTime);
+		}
+
+		for(int i = 0; i < count; ++i)
+		{
+			for(int c = 0; c < channels; ++c)
+				*buff++ = (int16_t)(block[c][i]*(32768>>1));
+		}
+		samples -= count*channels;
 	}
 
+	// The buffer goes back to SDL when the callback returns.
+	if(latencyProbe)
+		latencyProbe->delivered(synth->getFramesRendered());
+
 	auto interval = std::chrono::high_resolution_clock::now() - start_time;
 	auto ns = std::chrono::nanoseconds(interval);
 
@@ -50,6 +92,18 @@ static void audio_fill_buffer_s16(void* userdata, Uint8* stream, int len)
 }
 
 
+static float to_db(float v) { return 20.f*log10f(v + 1e-9f); }
+
+// Level meter over the bottom 60 dB.
+static void draw_meter(const char* label, float rms, float peak)
+{
+	char text[64];
+	snprintf(text, sizeof(text), "%s %6.1f dB rms %6.1f dB peak", label, to_db(rms), to_db(peak));
+	float fraction = (to_db(rms) + 60.f) / 60.f;
+	ImGui::ProgressBar(fraction < 0.f ? 0.f : (fraction > 1.f ? 1.f : fraction), ImVec2(512, 0), text);
+}
+
+
 static SDL_Window* window = nullptr;
 
 static void open_window()
@@ -125,7 +179,7 @@ static void draw_algo_rep(const Algorithm* _algo)
 }
 
  
-int main(int /*argc*/, char* /*argv*/[])
+int main(int argc, char* argv[])
 {
 	VulkFM vulkSynth;
 
@@ -141,7 +195,7 @@ int main(int /*argc*/, char* /*argv*/[])
 	want.freq = 44100;
 	want.format = AUDIO_S16SYS;
 	// want.format = AUDIO_F32SYS;
-	want.channels = 1;
+	want.channels = 2;
 	want.samples = 800;
 	want.userdata = &vulkSynth;
 	want.callback = audio_fill_buffer_s16;
@@ -190,6 +244,59 @@ int main(int /*argc*/, char* /*argv*/[])
 	ImGui_ImplSdlGL3_Init(window);
 
 	sampTime = 1.0f/got.freq;
+	audioChannels = got.channels == 2 ? 2 : 1;
+
+	// Optional midi file to play, keyboard still works on top of it.
+	std::string midiData;
+	if(argc > 1)
+	{
+		FILE* f = fopen(argv[1], "rb");
+		if(f != nullptr)
+		{
+			char chunk[4096];
+			size_t n;
+			while((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+				midiData.append(chunk, n);
+			fclose(f);
+		}
+
+		static MidiPlayer player(&vulkSynth, (float)got.freq);
+		if(player.load((const uint8_t*)midiData.data(), midiData.size()))
+			midiPlayer = &player;
+		else
+			printf("Could not load midi file %s\n", argv[1]);
+	}
+
+	// Microtuning, .scl, .kbm or .tun files separated by ':', loaded in order.
+	const char* tuningEnv = getenv("VULKFM_TUNING");
+	if(tuningEnv != nullptr)
+	{
+		std::string paths(tuningEnv);
+		size_t start = 0;
+		while(start <= paths.size())
+		{
+			size_t end = paths.find(':', start);
+			std::string path = paths.substr(start, end == std::string::npos ? std::string::npos : end - start);
+			if(!path.empty() && !vulkSynth.getTuning()->loadFile(path.c_str()))
+				printf("Could not load tuning %s\n", path.c_str());
+			if(end == std::string::npos)
+				break;
+			start = end + 1;
+		}
+	}
+
+	const char* latencyEnv = getenv("VULKFM_LATENCY");
+	if(latencyEnv != nullptr && atoi(latencyEnv) != 0)
+	{
+		static LatencyProbe probe(1 << 16);
+		latencyProbe = &probe;
+		vulkSynth.setLatencyProbe(&probe);
+	}
+
+	// Spectrum and meters run on their own thread, fed from the audio callback.
+	static Analyzer analyzer;
+	if(analyzer.start(2048, 1024))
+		vulkSynth.setAnalyzer(&analyzer);
 
 	SDL_PauseAudioDevice(audio_device,0);
 
@@ -281,6 +388,17 @@ int main(int /*argc*/, char* /*argv*/[])
 				ImGui::TreePop();
 			}
 
+			if(ImGui::TreeNode("Tuning"))
+			{
+				Tuning* tuning = vulkSynth.getTuning();
+				float reference = tuning->reference();
+				if(ImGui::SliderFloat("Reference (Hz)", &reference, 400.0f, 480.0f))
+					tuning->setReference(reference, tuning->referenceNote());
+				if(ImGui::Button("Equal temperament"))
+					tuning->setEqual();
+				ImGui::TreePop();
+			}
+
 
 			ImGui::End();
 
@@ -292,6 +410,40 @@ int main(int /*argc*/, char* /*argv*/[])
 
 			ImGui::End();
 
+			// Latest analysis, spectrum of the mix or of one operator of the last played voice.
+			static AnalyzerResult analysis;
+			static int analysisSource = 0;
+			analyzer.latest(&analysis, analysis.serial);
+
+			ImGui::SetNextWindowSize(ImVec2(528,480));
+			ImGui::Begin("Analyzer");
+
+			draw_meter("L", analysis.rmsLeft, analysis.peakLeft);
+			draw_meter("R", analysis.rmsRight, analysis.peakRight);
+
+			const char* sourceNames[] { "Mix", "Op 1", "Op 2", "Op 3", "Op 4", "Op 5", "Op 6", "Op 7", "Op 8" };
+			ImGui::Combo("Source", &analysisSource, sourceNames, 1 + analysis.opCount);
+			if(analysisSource > analysis.opCount)
+				analysisSource = 0;
+			const AnalyzerSpectrum& spectrum = analysisSource == 0 ? analysis.mix : analysis.ops[analysisSource-1];
+
+			ImGui::PlotLines("", spectrum.db, spectrum.bins, 0, NULL, -120.f, 0.f, ImVec2(512,200), sizeof(float));
+			ImGui::Text("0 - %.0f Hz, centroid %.0f Hz", spectrum.binHz*(spectrum.bins-1), spectrum.centroid);
+
+			if(analysis.opCount > 0)
+			{
+				ImGui::Separator();
+				ImGui::Text("Note %d", analysis.note);
+				for(int i = 0; i < analysis.opCount; ++i)
+				{
+					const AnalyzerSpectrum& op = analysis.ops[i];
+					ImGui::Text("Op %d  %6.1f dB rms  %6.1f dB peak  centroid %6.0f Hz", i+1, to_db(op.rms), to_db(op.peak), op.centroid);
+				}
+			}
+			ImGui::Text("Dropped blocks %llu", (unsigned long long)analysis.dropped);
+
+			ImGui::End();
+
 			// Show algorithm data
 			ImGui::Begin("Instrument");
 
@@ -314,6 +466,12 @@ int main(int /*argc*/, char* /*argv*/[])
 
 			draw_algo_rep(instrument->algo_);
 
+			ImGui::SliderInt("Unison", &instrument->unison, 1, MAX_UNISON);
+			ImGui::SliderFloat("Detune (cents)", &instrument->unisonDetune, 0.0f, 100.0f);
+			ImGui::SliderFloat("Phase spread", &instrument->unisonPhaseSpread, 0.0f, 1.0f);
+			ImGui::SliderFloat("Gain", &instrument->gain, 0.0f, 2.0f);
+			ImGui::SliderFloat("Pan", &instrument->pan, -1.0f, 1.0f);
+			ImGui::SliderFloat("Velocity", &instrument->velocitySens, 0.0f, 1.0f);
 
 			if(ImGui::TreeNode("Operators"))
 			{
@@ -364,6 +522,13 @@ int main(int /*argc*/, char* /*argv*/[])
 	printf("leaving\n");
 	SDL_DestroyWindow(window);
 	SDL_CloseAudio();
+	analyzer.stop();
+	if(latencyProbe)
+	{
+		SDL_PauseAudioDevice(audio_device, 1);
+		printf("audio driver %s, %d frame buffers\n", SDL_GetCurrentAudioDriver(), got.samples);
+		latencyProbe->report(stdout);
+	}
 	SDL_Quit();
 	return 0;
 }
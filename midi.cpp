@@ -0,0 +1,376 @@
+
+#include "midi.h"
+#include "vulkfm.h"
+
+#include <cstring>
+
+static inline uint32_t read_be32(const uint8_t* p) { return (uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | p[3]; }
+static inline uint16_t read_be16(const uint8_t* p) { return (uint16_t)(p[0]<<8 | p[1]); }
+
+// Data bytes following a channel status byte
+static inline int8_t channel_data_len(uint8_t status) { return ((status&0xE0) == 0xC0) ? 1 : 2; }
+
+// Data bytes following a system common status byte
+static inline int8_t common_data_len(uint8_t status)
+{
+	switch(status) {
+	case 0xF1: return 1;	// MTC quarter frame
+	case 0xF2: return 2;	// song position
+	case 0xF3: return 1;	// song select
+	default:   return 0;
+	}
+}
+
+
+MidiParser::MidiParser() { reset(); }
+
+void MidiParser::reset()
+{
+	status_ = 0;
+	needed_ = 0;
+	count_ = 0;
+	sysex_ = false;
+}
+
+bool MidiParser::feed(uint8_t byte, MidiMessage& msg)
+{
+	if(byte >= 0xF8) {
+		// Realtime, may appear anywhere and does not affect running status.
+		return false;
+	}
+
+	if(byte & 0x80) {
+		count_ = 0;
+		if(byte == 0xF0) { sysex_ = true; status_ = 0; return false; }
+		if(byte == 0xF7) { sysex_ = false; return false; }
+		sysex_ = false;
+		if(byte >= 0xF0) {
+			// System common cancels running status, data is parsed and dropped.
+			needed_ = common_data_len(byte);
+			status_ = needed_ > 0 ? byte : 0;
+			return false;
+		}
+		status_ = byte;
+		needed_ = channel_data_len(byte);
+		return false;
+	}
+
+	if(sysex_ || status_ == 0)
+		return false;
+
+	data_[count_++] = byte;
+	if(count_ < needed_)
+		return false;
+
+	count_ = 0;
+	if(status_ >= 0xF0) {
+		status_ = 0;
+		return false;
+	}
+
+	msg.status = status_ & 0xF0;
+	msg.channel = status_ & 0x0F;
+	msg.data1 = data_[0];
+	msg.data2 = needed_ > 1 ? data_[1] : 0;
+	return true;
+}
+
+//---------------------------------------------------
+
+// Variable length quantity, max 4 bytes. Returns false if it runs past end.
+static bool read_vlq(const uint8_t*& pos, const uint8_t* end, uint32_t& value)
+{
+	value = 0;
+	for(int i = 0; i < 4; ++i) {
+		if(pos >= end)
+			return false;
+		uint8_t b = *pos++;
+		value = (value<<7) | (b&0x7F);
+		if(!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+
+SmfReader::SmfReader()
+: trackCount_(0)
+, format_(0)
+, division_(0)
+{
+	rewind();
+}
+
+bool SmfReader::open(const uint8_t* data, size_t size)
+{
+	trackCount_ = 0;
+	if(size < 14 || memcmp(data, "MThd", 4) != 0)
+		return false;
+
+	uint32_t headerLen = read_be32(data+4);
+	if(headerLen < 6 || 8+(size_t)headerLen > size)
+		return false;
+
+	format_ = read_be16(data+8);
+	division_ = read_be16(data+12);
+	if(format_ > 1 || division_ == 0)
+		return false;
+
+	const uint8_t* pos = data + 8 + headerLen;
+	const uint8_t* end = data + size;
+
+	while(end - pos >= 8 && trackCount_ < MAX_SMF_TRACKS) {
+		uint32_t len = read_be32(pos+4);
+		const uint8_t* body = pos + 8;
+		if(len > (size_t)(end-body))
+			len = (uint32_t)(end-body); // truncated file, play what's there
+
+		if(memcmp(pos, "MTrk", 4) == 0) {
+			Track& t = tracks_[trackCount_++];
+			t.start = body;
+			t.end = body + len;
+		}
+		pos = body + len;
+	}
+
+	rewind();
+	return trackCount_ > 0;
+}
+
+void SmfReader::rewind()
+{
+	tempo_ = 500000; // 120 bpm
+	tempoTick_ = 0;
+	tempoSeconds_ = 0;
+
+	for(int i = 0; i < trackCount_; ++i) {
+		Track& t = tracks_[i];
+		t.pos = t.start;
+		t.tick = 0;
+		t.status = 0;
+		t.done = false;
+		readDelta(t);
+	}
+}
+
+bool SmfReader::readDelta(Track& t)
+{
+	uint32_t delta;
+	if(!read_vlq(t.pos, t.end, delta)) {
+		t.done = true;
+		return false;
+	}
+	t.tick += delta;
+	return true;
+}
+
+double SmfReader::tickToSeconds(uint64_t tick)
+{
+	if(division_ & 0x8000) {
+		// SMPTE time, negative frame rate in high byte and ticks per frame in low.
+		int fps = -(int8_t)(division_>>8);
+		double rate = (fps == 29 ? 29.97 : fps) * (division_&0xFF);
+		return tick / rate;
+	}
+	return tempoSeconds_ + (double)(tick - tempoTick_) * tempo_ / (1000000.0 * division_);
+}
+
+bool SmfReader::next(MidiMessage& msg, double& seconds)
+{
+	for(;;) {
+		// Earliest pending event, lowest track first on ties so that tempo
+		// changes in the conductor track apply before notes on the same tick.
+		Track* t = nullptr;
+		for(int i = 0; i < trackCount_; ++i) {
+			if(!tracks_[i].done && (t == nullptr || tracks_[i].tick < t->tick))
+				t = &tracks_[i];
+		}
+		if(t == nullptr)
+			return false;
+
+		if(t->pos >= t->end) { t->done = true; continue; }
+
+		uint8_t status = t->status;
+		if(*t->pos & 0x80)
+			status = *t->pos++;
+
+		if(status == 0xFF || status == 0xF0 || status == 0xF7) {
+			// Meta and sysex events, only tempo matters here.
+			uint8_t type = 0;
+			if(status == 0xFF && t->pos < t->end)
+				type = *t->pos++;
+
+			uint32_t len;
+			if(!read_vlq(t->pos, t->end, len) || len > (size_t)(t->end - t->pos)) {
+				t->done = true;
+				continue;
+			}
+
+			if(type == 0x51 && len == 3) {
+				tempoSeconds_ = tickToSeconds(t->tick);
+				tempoTick_ = t->tick;
+				tempo_ = (uint32_t)t->pos[0]<<16 | (uint32_t)t->pos[1]<<8 | t->pos[2];
+			}
+			else if(type == 0x2F) {
+				t->done = true;
+				continue;
+			}
+
+			t->pos += len;
+			t->status = 0;
+			readDelta(*t);
+			continue;
+		}
+
+		if(status < 0x80 || status >= 0xF0) {
+			// No running status to use or stray system byte, track is broken.
+			t->done = true;
+			continue;
+		}
+
+		int8_t len = channel_data_len(status);
+		if(t->end - t->pos < len) {
+			t->done = true;
+			continue;
+		}
+
+		t->status = status;
+		msg.status = status & 0xF0;
+		msg.channel = status & 0x0F;
+		msg.data1 = t->pos[0] & 0x7F;
+		msg.data2 = len > 1 ? (t->pos[1] & 0x7F) : 0;
+		t->pos += len;
+
+		seconds = tickToSeconds(t->tick);
+		readDelta(*t);
+		return true;
+	}
+}
+
+//---------------------------------------------------
+
+MidiPlayer::MidiPlayer(VulkFM* synth, float sampleRate)
+: synth_(synth)
+, sampleRate_(sampleRate)
+, dt_(1.f/sampleRate)
+, loaded_(false)
+, pendingFrame_(0)
+, hasPending_(false)
+, frame_(0)
+, eventCount_(0)
+, queued_(false)
+{
+}
+
+bool MidiPlayer::load(const uint8_t* data, size_t size)
+{
+	loaded_ = reader_.open(data, size);
+	rewind();
+	return loaded_;
+}
+
+void MidiPlayer::rewind()
+{
+	reader_.rewind();
+	parser_.reset();
+	frame_ = 0;
+	eventCount_ = 0;
+	hasPending_ = false;
+	fetch();
+}
+
+bool MidiPlayer::fetch()
+{
+	double seconds;
+	hasPending_ = loaded_ && reader_.next(pending_, seconds);
+	if(hasPending_)
+		pendingFrame_ = (uint64_t)(seconds * sampleRate_ + 0.5);
+	return hasPending_;
+}
+
+bool MidiPlayer::finished() const
+{
+	return loaded_ && !hasPending_ && synth_->activeVoices() == 0;
+}
+
+int MidiPlayer::render(float* out, int frames)
+{
+	return renderRuns(out, nullptr, frames);
+}
+
+int MidiPlayer::renderOutputs(float* const* outs, int frames)
+{
+	return renderRuns(nullptr, outs, frames);
+}
+
+int MidiPlayer::renderRuns(float* mono, float* const* outs, int frames)
+{
+	const int channels = 2*synth_->getOutputCount();
+	float* runOuts[2*MAX_OUTPUTS];
+
+	int done = 0;
+	while(done < frames) {
+		while(hasPending_ && pendingFrame_ <= frame_) {
+			dispatch(pending_);
+			fetch();
+		}
+
+		if(finished())
+			break;
+
+		int run = frames - done;
+		if(hasPending_ && pendingFrame_ - frame_ < (uint64_t)run)
+			run = (int)(pendingFrame_ - frame_);
+
+		if(mono != nullptr) {
+			synth_->render(mono + done, run, dt_);
+		}
+		else {
+			for(int c = 0; c < channels; ++c)
+				runOuts[c] = outs[c] ? outs[c] + done : nullptr;
+			synth_->renderOutputs(runOuts, run, dt_);
+		}
+		done += run;
+		frame_ += run;
+	}
+	return done;
+}
+
+void MidiPlayer::feed(const uint8_t* bytes, int count)
+{
+	MidiMessage msg;
+	for(int i = 0; i < count; ++i) {
+		if(parser_.feed(bytes[i], msg))
+			dispatch(msg);
+	}
+}
+
+void MidiPlayer::dispatch(const MidiMessage& msg)
+{
+	switch(msg.status) {
+	case MidiNoteOn:
+		if(msg.data2 != 0) {
+			if(queued_)
+				synth_->trigger(msg.data1, msg.channel, msg.data2);
+			else
+				synth_->noteOn(msg.data1, msg.channel, msg.data2);
+			break;
+		}
+		// Note on with zero velocity is a note off
+		// fall through
+	case MidiNoteOff:
+		if(queued_)
+			synth_->release(msg.data1, msg.channel, msg.data2);
+		else
+			synth_->noteOff(msg.data1, msg.channel);
+		break;
+	default:
+		// Controllers and the rest are not handled by the engine yet
+		break;
+	}
+
+	// Apply right away so a dense chord can't overflow the event queue.
+	if(queued_)
+		synth_->processEvents();
+	eventCount_++;
+}
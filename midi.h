@@ -0,0 +1,147 @@
+#if !defined(MIDI_H_)
+#define MIDI_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#define MAX_SMF_TRACKS 64
+
+class VulkFM;
+
+enum EMidiStatus
+{
+	MidiNoteOff			= 0x80,
+	MidiNoteOn			= 0x90,
+	MidiPolyPressure	= 0xA0,
+	MidiControlChange	= 0xB0,
+	MidiProgramChange	= 0xC0,
+	MidiChannelPressure	= 0xD0,
+	MidiPitchBend		= 0xE0,
+};
+
+struct MidiMessage
+{
+	uint8_t status = 0;		// status byte with channel stripped
+	uint8_t channel = 0;
+	uint8_t data1 = 0;
+	uint8_t data2 = 0;
+};
+
+
+// Parses a raw MIDI byte stream (as it comes off a wire or a driver) one byte at
+// a time. Handles running status, system common messages and realtime bytes
+// interleaved in the middle of a message. SysEx is skipped.
+class MidiParser
+{
+public:
+	MidiParser();
+	void reset();
+
+	// Returns true when a complete channel message is available in msg.
+	bool feed(uint8_t byte, MidiMessage& msg);
+
+protected:
+	uint8_t status_;		// running status, 0 if none
+	uint8_t data_[2];
+	int8_t needed_;			// data bytes needed for current status
+	int8_t count_;
+	bool sysex_;
+};
+
+
+// Streaming reader for Standard MIDI Files, format 0 and 1. Reads directly from
+// the memory it is given (no copy, no allocation) and merges all tracks into a
+// single stream of channel messages in time order with the tempo map applied.
+class SmfReader
+{
+public:
+	SmfReader();
+
+	// data must stay valid for as long as the reader is used.
+	bool open(const uint8_t* data, size_t size);
+	void rewind();
+
+	// Next channel message in time order, time in seconds since start.
+	bool next(MidiMessage& msg, double& seconds);
+
+	int format() const		{ return format_; }
+	int trackCount() const	{ return trackCount_; }
+	int division() const	{ return division_; }
+
+protected:
+	struct Track {
+		const uint8_t* start;
+		const uint8_t* pos;
+		const uint8_t* end;
+		uint64_t tick;		// absolute tick of the pending event
+		uint8_t status;		// running status
+		bool done;
+	};
+
+	bool readDelta(Track& t);
+	double tickToSeconds(uint64_t tick);
+
+	Track tracks_[MAX_SMF_TRACKS];
+	int trackCount_;
+	int format_;
+	int division_;
+
+	uint32_t tempo_;		// microseconds per quarter note
+	uint64_t tempoTick_;	// tick of last tempo change
+	double tempoSeconds_;	// time of last tempo change
+};
+
+
+// Feeds SMF playback or a live byte stream into the synth. Rendering is split at
+// event timestamps so events land on the exact sample they are due. Events are
+// applied with VulkFM::noteOn/noteOff, so everything here runs on the render
+// thread and other threads can keep using trigger().
+class MidiPlayer
+{
+public:
+	MidiPlayer(VulkFM* synth, float sampleRate);
+
+	bool load(const uint8_t* data, size_t size);
+	void rewind();
+
+	// Render frames of mono output. Returns frames rendered, which is less than
+	// asked for only when the song and all voices have finished.
+	int render(float* out, int frames);
+
+	// Same for all synth outputs, see VulkFM::renderOutputs.
+	int renderOutputs(float* const* outs, int frames);
+	bool finished() const;
+
+	// Parse raw MIDI bytes and dispatch them right away.
+	void feed(const uint8_t* bytes, int count);
+	void dispatch(const MidiMessage& msg);
+
+	// Send events through the synth's trigger() queue instead, so a latency
+	// probe sees them. Only when nothing else triggers notes.
+	void setQueued(bool queued)	{ queued_ = queued; }
+
+	uint64_t position() const	{ return frame_; }
+	uint64_t eventCount() const	{ return eventCount_; }
+
+protected:
+	bool fetch();
+	int renderRuns(float* mono, float* const* outs, int frames);
+
+	VulkFM* synth_;
+	float sampleRate_;
+	float dt_;
+
+	SmfReader reader_;
+	MidiParser parser_;
+	bool loaded_;
+
+	MidiMessage pending_;
+	uint64_t pendingFrame_;
+	bool hasPending_;
+
+	uint64_t frame_;
+	uint64_t eventCount_;
+	bool queued_;
+};
+
+#endif
@@ -0,0 +1,305 @@
+
+#include "notecache.h"
+
+#include <cstring>
+
+static inline size_t align_up(size_t v) { return (v + 63) & ~(size_t)63; }
+
+static int bucketCountFor(int chunks)
+{
+	int n = 1;
+	while(n < chunks)
+		n <<= 1;
+	return n;
+}
+
+
+NoteCache::NoteCache()
+: chunkCount_(0)
+, maxFrames_(0)
+, chunks_(nullptr)
+, chunkNext_(nullptr)
+, entries_(nullptr)
+, buckets_(nullptr)
+, bucketMask_(0)
+, freeChunk_(-1)
+, freeEntry_(-1)
+, lruHead_(-1)
+, lruTail_(-1)
+{
+}
+
+// Every recording holds at least one chunk, so there are as many entries as chunks.
+size_t NoteCache::memorySize(size_t budget)
+{
+	int chunks = (int)(budget / NOTE_CACHE_CHUNK);
+	if(chunks <= 0)
+		return 0;
+	return align_up((size_t)chunks * NOTE_CACHE_CHUNK)
+		+ align_up(sizeof(int) * chunks)
+		+ align_up(sizeof(Entry) * chunks)
+		+ align_up(sizeof(int) * bucketCountFor(chunks));
+}
+
+void NoteCache::init(void* mem, size_t budget, int maxFrames)
+{
+	chunkCount_ = mem != nullptr ? (int)(budget / NOTE_CACHE_CHUNK) : 0;
+	maxFrames_ = maxFrames;
+	stats_ = NoteCacheStats();
+	if(chunkCount_ <= 0) {
+		chunkCount_ = 0;
+		return;
+	}
+
+	const int bucketCount = bucketCountFor(chunkCount_);
+	uint8_t* p = (uint8_t*)mem;
+	chunks_ = p;
+	p += align_up((size_t)chunkCount_ * NOTE_CACHE_CHUNK);
+	chunkNext_ = (int*)p;
+	p += align_up(sizeof(int) * chunkCount_);
+	entries_ = (Entry*)p;
+	p += align_up(sizeof(Entry) * chunkCount_);
+	buckets_ = (int*)p;
+	bucketMask_ = bucketCount - 1;
+
+	for(int i = 0; i < chunkCount_; ++i) {
+		chunkNext_[i] = i+1 < chunkCount_ ? i+1 : -1;
+		memset(&entries_[i], 0, sizeof(Entry));
+		entries_[i].bucketNext = i+1 < chunkCount_ ? i+1 : -1;
+	}
+	for(int i = 0; i < bucketCount; ++i)
+		buckets_[i] = -1;
+
+	freeChunk_ = 0;
+	freeEntry_ = 0;
+	lruHead_ = lruTail_ = -1;
+	stats_.bytes = (size_t)chunkCount_ * NOTE_CACHE_CHUNK;
+}
+
+int NoteCache::bucketOf(uint64_t key, int note) const
+{
+	uint64_t h = (key ^ (uint64_t)note) * 0x9E3779B97F4A7C15ull;
+	return (int)(h >> 32) & bucketMask_;
+}
+
+float* NoteCache::recordAt(const Entry& e, int record) const
+{
+	int chunk = e.firstChunk;
+	for(int i = record / e.perChunk; i > 0; --i)
+		chunk = chunkNext_[chunk];
+	return (float*)(chunks_ + (size_t)chunk * NOTE_CACHE_CHUNK) + (record % e.perChunk) * e.recordFloats;
+}
+
+
+void NoteCache::lruUnlink(Entry& e)
+{
+	if(e.lruPrev >= 0) entries_[e.lruPrev].lruNext = e.lruNext; else lruHead_ = e.lruNext;
+	if(e.lruNext >= 0) entries_[e.lruNext].lruPrev = e.lruPrev; else lruTail_ = e.lruPrev;
+	e.lruPrev = e.lruNext = -1;
+}
+
+void NoteCache::lruPushFront(int idx)
+{
+	Entry& e = entries_[idx];
+	e.lruPrev = -1;
+	e.lruNext = lruHead_;
+	if(lruHead_ >= 0)
+		entries_[lruHead_].lruPrev = idx;
+	lruHead_ = idx;
+	if(lruTail_ < 0)
+		lruTail_ = idx;
+}
+
+// Give back the chunks and the entry. Complete entries are unlinked from the
+// hash chain and the lru list as well.
+void NoteCache::freeEntry(int idx)
+{
+	Entry& e = entries_[idx];
+	if(e.complete) {
+		int* link = &buckets_[bucketOf(e.key, e.note)];
+		while(*link != idx)
+			link = &entries_[*link].bucketNext;
+		*link = e.bucketNext;
+		lruUnlink(e);
+		stats_.entries--;
+	}
+
+	if(e.chunks > 0) {
+		chunkNext_[e.lastChunk] = freeChunk_;
+		freeChunk_ = e.firstChunk;
+		stats_.bytesUsed -= (size_t)e.chunks * NOTE_CACHE_CHUNK;
+	}
+
+	e.complete = false;
+	e.bucketNext = freeEntry_;
+	freeEntry_ = idx;
+}
+
+// Drop the least recently used recording nobody is playing.
+bool NoteCache::evictOne()
+{
+	for(int idx = lruTail_; idx >= 0; idx = entries_[idx].lruPrev) {
+		if(entries_[idx].pins == 0) {
+			freeEntry(idx);
+			stats_.evictions++;
+			return true;
+		}
+	}
+	return false;
+}
+
+int NoteCache::takeChunk()
+{
+	while(freeChunk_ < 0) {
+		if(!evictOne())
+			return -1;
+	}
+	int chunk = freeChunk_;
+	freeChunk_ = chunkNext_[chunk];
+	chunkNext_[chunk] = -1;
+	stats_.bytesUsed += NOTE_CACHE_CHUNK;
+	return chunk;
+}
+
+
+int NoteCache::find(uint64_t key, int note)
+{
+	if(!enabled())
+		return -1;
+
+	for(int idx = buckets_[bucketOf(key, note)]; idx >= 0; idx = entries_[idx].bucketNext) {
+		Entry& e = entries_[idx];
+		if(e.key == key && e.note == note) {
+			e.pins++;
+			lruUnlink(e);
+			lruPushFront(idx);
+			stats_.hits++;
+			return idx;
+		}
+	}
+	stats_.misses++;
+	return -1;
+}
+
+void NoteCache::unpin(int entry)
+{
+	if(entry >= 0 && entries_[entry].pins > 0)
+		entries_[entry].pins--;
+}
+
+int NoteCache::record(uint64_t key, int note, int stateSize)
+{
+	const int recordFloats = stateSize + NOTE_CACHE_RECORD;
+	if(!enabled() || recordFloats * (int)sizeof(float) > NOTE_CACHE_CHUNK)
+		return -1;
+
+	while(freeEntry_ < 0) {
+		if(!evictOne())
+			return -1;
+	}
+
+	int idx = freeEntry_;
+	Entry& e = entries_[idx];
+	freeEntry_ = e.bucketNext;
+
+	e.key = key;
+	e.note = note;
+	e.length = 0;
+	e.records = 0;
+	e.recordFloats = recordFloats;
+	e.perChunk = NOTE_CACHE_CHUNK / (recordFloats * (int)sizeof(float));
+	e.firstChunk = e.lastChunk = -1;
+	e.chunks = 0;
+	e.pins = 1;
+	e.complete = false;
+	e.lruPrev = e.lruNext = -1;
+	e.bucketNext = -1;
+	return idx;
+}
+
+float* NoteCache::addState(int entry)
+{
+	Entry& e = entries_[entry];
+	if((e.records + 1) * NOTE_CACHE_RECORD > maxFrames_ || e.length != e.records * NOTE_CACHE_RECORD)
+		return nullptr;
+
+	if(e.records == e.chunks * e.perChunk) {
+		int chunk = takeChunk();
+		if(chunk < 0)
+			return nullptr;
+		if(e.lastChunk >= 0)
+			chunkNext_[e.lastChunk] = chunk;
+		else
+			e.firstChunk = chunk;
+		e.lastChunk = chunk;
+		e.chunks++;
+	}
+
+	float* state = (float*)(chunks_ + (size_t)e.lastChunk * NOTE_CACHE_CHUNK) + (e.records % e.perChunk) * e.recordFloats;
+	e.records++;
+	return state;
+}
+
+void NoteCache::addSamples(int entry, const float* samples, int n)
+{
+	Entry& e = entries_[entry];
+	const int offset = e.length % NOTE_CACHE_RECORD;
+	float* record = (float*)(chunks_ + (size_t)e.lastChunk * NOTE_CACHE_CHUNK) + ((e.records-1) % e.perChunk) * e.recordFloats;
+	memcpy(record + (e.recordFloats - NOTE_CACHE_RECORD) + offset, samples, sizeof(float)*n);
+	e.length += n;
+}
+
+void NoteCache::finish(int entry)
+{
+	Entry& e = entries_[entry];
+	e.pins = 0;
+	if(e.length == 0) {
+		freeEntry(entry);
+		return;
+	}
+
+	// A recording of the same note finished first, keep that one.
+	for(int idx = buckets_[bucketOf(e.key, e.note)]; idx >= 0; idx = entries_[idx].bucketNext) {
+		if(entries_[idx].key == e.key && entries_[idx].note == e.note) {
+			freeEntry(entry);
+			return;
+		}
+	}
+
+	int& bucket = buckets_[bucketOf(e.key, e.note)];
+	e.bucketNext = bucket;
+	bucket = entry;
+	e.complete = true;
+	lruPushFront(entry);
+	stats_.entries++;
+	stats_.recorded++;
+}
+
+
+int NoteCache::read(int entry, int pos, float* out, int n) const
+{
+	const Entry& e = entries_[entry];
+	int done = 0;
+	while(done < n && pos < e.length) {
+		const int offset = pos % NOTE_CACHE_RECORD;
+		int run = NOTE_CACHE_RECORD - offset;
+		if(run > n - done) run = n - done;
+		if(run > e.length - pos) run = e.length - pos;
+
+		const float* record = recordAt(e, pos / NOTE_CACHE_RECORD);
+		memcpy(out + done, record + (e.recordFloats - NOTE_CACHE_RECORD) + offset, sizeof(float)*run);
+		done += run;
+		pos += run;
+	}
+	return done;
+}
+
+const float* NoteCache::state(int entry, int pos, int* start) const
+{
+	const Entry& e = entries_[entry];
+	int record = pos / NOTE_CACHE_RECORD;
+	if(record >= e.records)
+		record = e.records - 1;
+	*start = record * NOTE_CACHE_RECORD;
+	return recordAt(e, record);
+}
@@ -0,0 +1,136 @@
+#if !defined(NOTECACHE_H_)
+#define NOTECACHE_H_
+
+#include <cstdint>
+#include <cstddef>
+
+// Cache of rendered note attacks for offline rendering. A voice is
+// deterministic from trigger until its patch changes or it gets released, so
+// the first time a (patch, note) plays its output is recorded and later
+// triggers play the recording back instead of synthesizing.
+//
+// A recording is a list of records, each holding the voice state at its first
+// frame followed by NOTE_CACHE_RECORD frames of voice output. A voice playing
+// from the cache goes back to live synthesis by loading the state of the record
+// it is in and rendering the few frames up to its position.
+//
+// Memory is a fixed pool of chunks given at init, recordings grow a chunk at a
+// time and least recently used recordings are evicted to make room.
+
+#define NOTE_CACHE_RECORD 128				// frames per record
+#define NOTE_CACHE_CHUNK (16*1024)			// bytes
+
+enum ECacheMode
+{
+	CacheOff,
+	CachePending,		// decided on first render, when the sample rate is known
+	CacheRecording,
+	CachePlaying,
+};
+
+// Per voice cache state.
+struct CachedNote
+{
+	int8_t mode = CacheOff;
+	int entry = -1;
+	int pos = 0;			// frames since trigger
+	uint64_t key = 0;
+	float dt = 0;
+};
+
+struct NoteCacheStats
+{
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+	uint64_t recorded = 0;		// recordings completed
+	uint64_t divergences = 0;	// patch changed under a cached voice
+	int entries = 0;
+	size_t bytesUsed = 0;
+	size_t bytes = 0;
+};
+
+
+class NoteCache
+{
+public:
+	NoteCache();
+
+	// Bytes of memory needed for a cache of budget bytes of chunks.
+	static size_t memorySize(size_t budget);
+
+	// mem holds memorySize(budget) bytes, 64 byte aligned. Recordings stop at
+	// maxFrames.
+	void init(void* mem, size_t budget, int maxFrames);
+	bool enabled() const { return chunkCount_ > 0; }
+
+	// Complete recording for key and note, pinned until unpin(). -1 on a miss.
+	int find(uint64_t key, int note);
+	void unpin(int entry);
+
+	// Start a recording, voice states are stateSize floats. -1 if there is no room.
+	int record(uint64_t key, int note, int stateSize);
+
+	// Begin the next record, returns where to write the voice state or nullptr
+	// when the recording can't grow. Only at multiples of NOTE_CACHE_RECORD.
+	float* addState(int entry);
+
+	// Append frames to the current record, never past its end.
+	void addSamples(int entry, const float* samples, int n);
+
+	// Recording done, it can be found from now on. Empty recordings are dropped.
+	void finish(int entry);
+
+	// Copy up to n frames from pos, returns frames copied.
+	int read(int entry, int pos, float* out, int n) const;
+
+	// State of the last record starting at or before pos, *start is its frame.
+	const float* state(int entry, int pos, int* start) const;
+
+	const NoteCacheStats& stats() const { return stats_; }
+	NoteCacheStats& stats() { return stats_; }
+
+protected:
+	struct Entry
+	{
+		uint64_t key;
+		int note;
+		int length;			// frames
+		int records;
+		int recordFloats;	// state + NOTE_CACHE_RECORD
+		int perChunk;		// records per chunk
+		int firstChunk;
+		int lastChunk;
+		int chunks;
+		int pins;
+		bool complete;
+		int lruPrev;
+		int lruNext;
+		int bucketNext;		// hash chain, or free list when unused
+	};
+
+	float* recordAt(const Entry& e, int record) const;
+	int takeChunk();
+	bool evictOne();
+	void freeEntry(int idx);
+	void lruUnlink(Entry& e);
+	void lruPushFront(int idx);
+	int bucketOf(uint64_t key, int note) const;
+
+	int chunkCount_;
+	int maxFrames_;
+	uint8_t* chunks_;
+	int* chunkNext_;
+	Entry* entries_;
+	int* buckets_;
+	int bucketMask_;
+
+	int freeChunk_;
+	int freeEntry_;
+	int lruHead_;			// most recently used
+	int lruTail_;
+
+	NoteCacheStats stats_;
+};
+
+#endif
@@ -0,0 +1,126 @@
+
+#include "opgraph.h"
+#include "vulkfm.h"
+
+#include <cstring>
+
+
+bool OpGraph::connect(int from, int to, float depth)
+{
+	if(edgeCount >= MAX_OP_EDGES || from < 0 || to < 0 || from >= MAX_OPERATORS || to >= MAX_OPERATORS)
+		return false;
+
+	OpEdge& e = edges[edgeCount++];
+	e.from = (uint8_t)from;
+	e.to = (uint8_t)to;
+	e.depth = depth;
+	return true;
+}
+
+
+void algorithmToGraph(const Algorithm& algo, OpGraph& graph)
+{
+	graph.operatorCount = algo.operatorCount;
+	graph.edgeCount = 0;
+
+	for(int i = 0; i < algo.operatorCount; ++i) {
+		// Highest modulator first, keeps the summation order of the old evaluator.
+		for(int m = algo.operatorCount-1; m >= 0; --m) {
+			if(algo.mods[i] & (1u<<m))
+				graph.connect(m, i);
+		}
+		graph.outs[i] = (algo.outs & (1u<<i)) != 0;
+	}
+}
+
+
+bool compileGraph(const OpGraph& graph, CompiledAlgorithm& out)
+{
+	const int count = graph.operatorCount;
+	if(count <= 0 || count > MAX_OPERATORS || graph.edgeCount > MAX_OP_EDGES)
+		return false;
+
+	for(int e = 0; e < graph.edgeCount; ++e) {
+		if(graph.edges[e].from >= count || graph.edges[e].to >= count)
+			return false;
+	}
+
+	// Unresolved inputs per operator, self-feedback never blocks.
+	int pending[MAX_OPERATORS] = {};
+	bool placed[MAX_OPERATORS] = {};
+	for(int e = 0; e < graph.edgeCount; ++e) {
+		if(graph.edges[e].from != graph.edges[e].to)
+			pending[graph.edges[e].to]++;
+	}
+
+	out.operatorCount = count;
+	out.outputCount = 0;
+	out.feedback = false;
+	out.cyclic = false;
+
+	int faninCount = 0;
+	for(int n = 0; n < count; ++n) {
+		int next = -1;
+		for(int i = count-1; i >= 0; --i) {
+			if(!placed[i] && pending[i] == 0) { next = i; break; }
+		}
+
+		if(next < 0) {
+			// Only cycles left, break one. Its open inputs read last sample.
+			for(int i = count-1; i >= 0 && next < 0; --i) {
+				if(!placed[i]) next = i;
+			}
+		}
+
+		placed[next] = true;
+
+		OpInstr& in = out.instr[n];
+		in.op = (uint8_t)next;
+		in.faninStart = (uint16_t)faninCount;
+		in.faninCount = 0;
+		in.output = graph.outs[next];
+		in.selfDepth = 0.f;
+
+		for(int e = 0; e < graph.edgeCount; ++e) {
+			const OpEdge& edge = graph.edges[e];
+			if(edge.to == next) {
+				out.fanin[faninCount].op = edge.from;
+				out.fanin[faninCount].depth = edge.depth;
+				faninCount++;
+				in.faninCount++;
+				if(edge.from == next) {
+					in.selfDepth += edge.depth;
+					out.feedback = true;
+				}
+				else if(!placed[edge.from]) {
+					out.feedback = true;
+					out.cyclic = true;
+				}
+			}
+			else if(edge.from == next && edge.from != edge.to) {
+				pending[edge.to]--;
+			}
+		}
+
+		out.isOutput[next] = in.output;
+		if(in.output)
+			out.outputCount++;
+	}
+	return true;
+}
+
+void copyCompiled(CompiledAlgorithm& dst, const CompiledAlgorithm& src)
+{
+	const int count = src.operatorCount;
+	dst.operatorCount = count;
+	dst.outputCount = src.outputCount;
+	dst.feedback = src.feedback;
+	dst.cyclic = src.cyclic;
+	if(count <= 0)
+		return;
+	// Inputs are laid out in instruction order.
+	const OpInstr& last = src.instr[count-1];
+	memcpy(dst.instr, src.instr, sizeof(OpInstr)*count);
+	memcpy(dst.fanin, src.fanin, sizeof(OpInput)*(last.faninStart + last.faninCount));
+	memcpy(dst.isOutput, src.isOutput, sizeof(bool)*count);
+}
@@ -0,0 +1,74 @@
+#if !defined(OPGRAPH_H_)
+#define OPGRAPH_H_
+
+#include <cstdint>
+
+#define MAX_OPERATORS 32
+#define MAX_OP_EDGES (MAX_OPERATORS*4)
+
+struct Algorithm;
+
+
+// One modulation connection, output of from is added to the phase of to.
+// from == to is operator self-feedback.
+struct OpEdge
+{
+	uint8_t from;
+	uint8_t to;
+	float depth;
+};
+
+// Free form operator graph, any number of operators up to MAX_OPERATORS and any
+// routing including cycles. Used to describe a patch, compiled before playing.
+struct OpGraph
+{
+	int operatorCount = 0;
+	int edgeCount = 0;
+	OpEdge edges[MAX_OP_EDGES];
+	bool outs[MAX_OPERATORS] = {};	// operators mixed to voice out
+
+	bool connect(int from, int to, float depth = 1.0f);
+};
+
+
+struct OpInput
+{
+	uint8_t op;
+	float depth;
+};
+
+struct OpInstr
+{
+	uint8_t op;				// operator to evaluate
+	uint8_t faninCount;
+	uint16_t faninStart;	// first input in CompiledAlgorithm::fanin
+	bool output;			// mix to voice out
+	float selfDepth;		// sum of self-feedback edges, also in fanin
+};
+
+// Flattened evaluation order for a graph. Operators are evaluated in instr
+// order, reading their modulators from Voice outs. An input that is evaluated
+// later in the order (a cycle or self-feedback) reads the previous sample.
+struct CompiledAlgorithm
+{
+	int operatorCount = 0;
+	int outputCount = 0;
+	bool feedback = false;	// some input reads the previous sample
+	bool cyclic = false;	// feedback through other operators, not only self
+	OpInstr instr[MAX_OPERATORS];
+	OpInput fanin[MAX_OP_EDGES];
+	bool isOutput[MAX_OPERATORS] = {};
+};
+
+
+// Topologically sort the graph, highest index first among ready operators. Cycles
+// are broken at the highest remaining operator. Returns false on a bad graph.
+bool compileGraph(const OpGraph& graph, CompiledAlgorithm& out);
+
+// Copies only the instructions and inputs in use, a small part of the struct.
+void copyCompiled(CompiledAlgorithm& dst, const CompiledAlgorithm& src);
+
+// Legacy bit mask algorithms as a graph.
+void algorithmToGraph(const Algorithm& algo, OpGraph& graph);
+
+#endif
@@ -0,0 +1,672 @@
+// Headless renderer, plays MIDI files through the engine as fast as possible.
+// Used for regression renders and for measuring throughput over MIDI corpora.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <new>
+#include <atomic>
+#include <thread>
+#include "vulkfm.h"
+#include "midi.h"
+#include "golden.h"
+#include "latency.h"
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#endif
+
+#define BLOCK_SIZE 512
+
+
+// Allocation check for the render path, enabled with -a. Every allocation
+// while the guard is up is counted and fails the run. With glibc the malloc
+// family is replaced by counting wrappers around the libc allocator, so C
+// allocations and the ones inside the standard library count too. Elsewhere
+// only operator new is seen.
+static bool allocGuard = false;
+static unsigned long allocCount = 0;
+
+#if defined(__GLIBC__)
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t align, size_t size);
+void __libc_free(void* p);
+
+static void* counted(void* p)
+{
+	if(allocGuard)
+		allocCount++;
+	return p;
+}
+
+void* malloc(size_t size) noexcept							{ return counted(__libc_malloc(size)); }
+void* calloc(size_t count, size_t size) noexcept			{ return counted(__libc_calloc(count, size)); }
+void* realloc(void* p, size_t size) noexcept				{ return counted(__libc_realloc(p, size)); }
+void* memalign(size_t align, size_t size) noexcept			{ return counted(__libc_memalign(align, size)); }
+void* aligned_alloc(size_t align, size_t size) noexcept		{ return counted(__libc_memalign(align, size)); }
+void free(void* p) noexcept									{ __libc_free(p); }
+
+int posix_memalign(void** out, size_t align, size_t size) noexcept
+{
+	if(align < sizeof(void*) || (align & (align - 1)) != 0)
+		return EINVAL;
+	void* p = counted(__libc_memalign(align, size));
+	if(p == nullptr)
+		return ENOMEM;
+	*out = p;
+	return 0;
+}
+}
+#endif
+
+void* operator new(size_t size)
+{
+#if !defined(__GLIBC__)
+	if(allocGuard)
+		allocCount++;
+#endif
+	void* p = malloc(size ? size : 1);
+	if(p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+
+static uint8_t* load_file(const char* path, size_t* size)
+{
+	FILE* f = fopen(path, "rb");
+	if(f == nullptr)
+		return nullptr;
+
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	uint8_t* data = nullptr;
+	if(len > 0) {
+		data = (uint8_t*)malloc(len);
+		if(data && fread(data, 1, len, f) != (size_t)len) {
+			free(data);
+			data = nullptr;
+		}
+	}
+	fclose(f);
+	*size = (size_t)len;
+	return data;
+}
+
+
+static void write_le32(FILE* f, uint32_t v) { uint8_t b[4] = { (uint8_t)v, (uint8_t)(v>>8), (uint8_t)(v>>16), (uint8_t)(v>>24) }; fwrite(b, 1, 4, f); }
+static void write_le16(FILE* f, uint16_t v) { uint8_t b[2] = { (uint8_t)v, (uint8_t)(v>>8) }; fwrite(b, 1, 2, f); }
+
+// 16 bit PCM wav, sizes are patched in by wav_close
+static FILE* wav_open(const char* path, int rate, int channels)
+{
+	FILE* f = fopen(path, "wb");
+	if(f == nullptr)
+		return nullptr;
+	fwrite("RIFF", 1, 4, f); write_le32(f, 0);
+	fwrite("WAVEfmt ", 1, 8, f); write_le32(f, 16);
+	write_le16(f, 1); write_le16(f, channels);
+	write_le32(f, rate); write_le32(f, rate*channels*2);
+	write_le16(f, channels*2); write_le16(f, 16);
+	fwrite("data", 1, 4, f); write_le32(f, 0);
+	return f;
+}
+
+static inline int16_t to_s16(float s)
+{
+	s = s<-1.f?-1.f:(s>1.f?1.f:s);
+	return (int16_t)(s*32767.f);
+}
+
+// Interleave frames of stereo to the file.
+static void wav_write(FILE* f, const float* left, const float* right, int frames)
+{
+	int16_t buff[BLOCK_SIZE*2];
+	while(frames > 0) {
+		int n = frames < BLOCK_SIZE ? frames : BLOCK_SIZE;
+		for(int i = 0; i < n; ++i) {
+			buff[i*2] = to_s16(left[i]);
+			buff[i*2+1] = to_s16(right[i]);
+		}
+		fwrite(buff, sizeof(int16_t), n*2, f);
+		left += n;
+		right += n;
+		frames -= n;
+	}
+}
+
+static void wav_close(FILE* f)
+{
+	long size = ftell(f);
+	fseek(f, 4, SEEK_SET); write_le32(f, (uint32_t)(size-8));
+	fseek(f, 40, SEEK_SET); write_le32(f, (uint32_t)(size-44));
+	fclose(f);
+}
+
+
+// Dummy audio device: a thread pulls buffers at the real time rate the way an
+// audio driver calls back, while this thread plays random notes like the
+// keyboard in play does. Reports note-on latency per stage.
+static int run_latency(int rate, int bufferFrames, double seconds, EKernelLevel level)
+{
+	VulkFM synth;
+	synth.setKernels(level);
+	LatencyProbe probe(1 << 16);
+	synth.setLatencyProbe(&probe);
+
+	float* buffer = (float*)malloc(sizeof(float) * 2*bufferFrames);
+	if(buffer == nullptr)
+		return 1;
+	float* outs[2] = { buffer, buffer + bufferFrames };
+	const float dt = 1.f/rate;
+	const std::chrono::duration<double> period(bufferFrames / (double)rate);
+	std::atomic<bool> running(true);
+	std::atomic<long> late(0);
+
+	std::thread device([&]() {
+		auto next = std::chrono::steady_clock::now();
+		while(running) {
+			synth.renderOutputs(outs, bufferFrames, dt);
+			probe.delivered(synth.getFramesRendered());
+			next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+			if(std::chrono::steady_clock::now() > next)
+				late++;
+			std::this_thread::sleep_until(next);
+		}
+	});
+
+	// Notes 20 to 150 ms apart, each held for two more notes.
+	srand(1);
+	int held[3] = { -1, -1, -1 };
+	auto end = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+	for(int i = 0; std::chrono::steady_clock::now() < end; ++i) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20 + rand() % 130));
+		if(held[i % 3] >= 0)
+			synth.release((int8_t)held[i % 3], 0, 0);
+		held[i % 3] = 36 + rand() % 48;
+		synth.trigger((int8_t)held[i % 3], 0, 100);
+	}
+	running = false;
+	device.join();
+	free(buffer);
+
+	printf("dummy device: %d Hz, %d frame buffers (%.1f ms), %ld late callbacks\n", rate, bufferFrames, period.count()*1000.0, (long)late);
+	probe.report(stdout);
+	return 0;
+}
+
+
+#if defined(__linux__)
+// Plays a file through a running vulkfmd, every MIDI channel on this client's
+// channel. The commands the daemon could need before it sees the next slot
+// freed go out first, so notes land on the same frames as a local render.
+static int run_client(const char* socketPath, const char* path, const char* outPath)
+{
+	size_t size = 0;
+	uint8_t* data = load_file(path, &size);
+	SmfReader reader;
+	if(data == nullptr || !reader.open(data, size)) {
+		printf("%s: not a type 0/1 midi file\n", path);
+		free(data);
+		return 1;
+	}
+
+	ServerClient client;
+	if(!client.connect(socketPath)) {
+		printf("%s: no daemon or no free client slot\n", socketPath);
+		free(data);
+		return 1;
+	}
+	const int rate = client.rate();
+	const int n = client.blockFrames();
+	const uint64_t blocks = client.ringBlocks();
+	FILE* wav = outPath ? wav_open(outPath, rate, 2) : nullptr;
+
+	MidiMessage msg;
+	double seconds;
+	bool more = reader.next(msg, seconds);
+	uint64_t events = 0;
+	auto sendUntil = [&](uint64_t horizon) {
+		for(; more; more = reader.next(msg, seconds)) {
+			const uint64_t frame = (uint64_t)(seconds * rate + 0.5);
+			if(frame >= horizon)
+				break;
+			if(msg.status == MidiNoteOn && msg.data2 != 0)
+				client.noteOn(frame, msg.data1, msg.data2);
+			else if(msg.status == MidiNoteOn || msg.status == MidiNoteOff)
+				client.noteOff(frame, msg.data1);
+			events++;
+		}
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	sendUntil(blocks*n);
+	client.start();
+
+	// After the song, until a silent block or ten seconds of tail.
+	uint64_t consumed = 0;
+	uint64_t tail = 0;
+	const float* s;
+	while((s = client.acquire(nullptr, 5000)) != nullptr) {
+		float peak = 0;
+		for(int i = 0; i < 2*n; ++i)
+			peak = fabsf(s[i]) > peak ? fabsf(s[i]) : peak;
+		if(wav)
+			wav_write(wav, s, s + n, n);
+		sendUntil((consumed + 1 + blocks)*n);
+		client.release();
+		consumed++;
+		if(!more && (peak == 0.f || ++tail*n > 10u*rate))
+			break;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	if(wav)
+		wav_close(wav);
+	const double audio = consumed*n / (double)rate;
+	printf("%s: %llu events, %.2fs audio in %.3fs, %.1fx realtime, %llu late commands, %llu dropped blocks\n",
+		path, (unsigned long long)events, audio, elapsed.count(), elapsed.count() > 0 ? audio/elapsed.count() : 0.0,
+		(unsigned long long)client.late(), (unsigned long long)client.dropped());
+	free(data);
+	return s == nullptr ? 1 : 0;
+}
+
+// Plays a note through ParamAlgorithm 0 -> 1 on the shared instrument, which
+// used to crash the daemon.
+static bool check_algo_change(const char* path)
+{
+	const int blocks = 32;
+	int received = 0;
+	float peakAfter = 0;
+	bool finite = true;
+	ServerClient client;
+	if(client.connect(path)) {
+		client.patch(0, ParamAlgorithm, 0, 0.f);
+		client.noteOn(1, 60, 100);
+		client.patch(2000, ParamAlgorithm, 0, 1.f);
+		client.noteOn(4000, 64, 100);
+		client.noteOff(6000, 60);
+		client.start();
+		const float* s;
+		uint64_t frame;
+		while(received < blocks && (s = client.acquire(&frame, 5000)) != nullptr) {
+			const int n = client.blockFrames();
+			for(int i = 0; i < 2*n; ++i) {
+				finite &= std::isfinite(s[i]);
+				if(frame + i%n >= 2000 && fabsf(s[i]) > peakAfter)
+					peakAfter = fabsf(s[i]);
+			}
+			client.release();
+			received++;
+		}
+	}
+
+	const bool pass = received == blocks && finite && peakAfter > 0.f;
+	printf("%-14s %-14s %d/%d blocks, peak %.3f after the change %s\n", "server", "algo change",
+		received, blocks, peakAfter, pass ? "ok" : "FAIL");
+	return pass;
+}
+
+// Client that scribbles over the ring header the server shares with it.
+class RingVandal : public ServerClient
+{
+public:
+	ServerRing* ring() { return ring_; }
+};
+
+// One client corrupts its ring header and read counter, the server has to
+// drop it and keep serving the other.
+static bool check_ring_abuse(const char* path)
+{
+	const int blocks = 32;
+	int received = 0;
+	bool dropped = false;
+	ServerClient client;
+	RingVandal vandal;
+	if(client.connect(path) && vandal.connect(path)) {
+		vandal.ring()->blocks = 1000000;
+		vandal.ring()->blockFrames = 1 << 30;
+		vandal.ring()->read.store(1000);
+		vandal.start();
+		client.noteOn(0, 60, 100);
+		client.start();
+		while(received < blocks && client.acquire(nullptr, 5000) != nullptr) {
+			client.release();
+			received++;
+		}
+		dropped = vandal.acquire(nullptr, 5000) == nullptr;
+	}
+
+	const bool pass = received == blocks && dropped;
+	printf("%-14s %-14s %d/%d blocks, corrupt client %s %s\n", "server", "ring abuse",
+		received, blocks, dropped ? "dropped" : "kept", pass ? "ok" : "FAIL");
+	return pass;
+}
+
+// A server in process for the client checks, run by -c.
+static int check_server()
+{
+	char dir[] = "/tmp/vulkfm-check-XXXXXX";
+	if(mkdtemp(dir) == nullptr) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char path[64];
+	snprintf(path, sizeof(path), "%s/check.sock", dir);
+
+	RenderServer server;
+	ServerConfig config;
+	config.blockFrames = 256;
+	if(!server.open(path, config)) {
+		perror(path);
+		rmdir(dir);
+		return 1;
+	}
+	std::thread thread([&] { server.run(); });
+
+	int failures = 0;
+	failures += check_algo_change(path) ? 0 : 1;
+	failures += check_ring_abuse(path) ? 0 : 1;
+
+	// A bare connection wakes the server out of poll.
+	server.stop();
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	const int wake = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(wake >= 0 && connect(wake, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		perror(path);
+	thread.join();
+	if(wake >= 0)
+		close(wake);
+	server.close();
+	rmdir(dir);
+	return failures;
+}
+#endif
+
+
+static void usage()
+{
+	printf("usage: render [-a] [-t] [-k level] [-r rate] [-m MB] [-p hz] [-u file] [-o out.wav [-s]] [-n loops] file.mid ...\n");
+	printf("       render -g dir | -c dir\n");
+	printf("       render -l seconds [-b frames] [-k level] [-r rate]\n");
+	printf("       render -d socket [-o out.wav] file.mid\n");
+	printf("  -a         fail if anything allocates while rendering\n");
+	printf("  -k level   kernels to use: scalar, sse2, avx2, avx512, default best\n");
+	printf("  -r rate    sample rate, default 44100\n");
+	printf("  -m MB      note render cache size, default off\n");
+	printf("  -p hz      pitch of note 57, default 432\n");
+	printf("  -u file    tuning, .scl, .kbm or .tun, may be given more than once\n");
+	printf("  -o file    write output of the (single) input to a stereo wav file\n");
+	printf("  -s         with -o, also write one stem per midi channel to file.chN.wav\n");
+	printf("  -n loops   render every file this many times, for timing\n");
+	printf("  -t         report note-on latency of every file, in render time and frames\n");
+	printf("  -l seconds play random notes through a real time dummy device, report latency\n");
+	printf("  -b frames  dummy device buffer size, default 800\n");
+	printf("  -d socket  play through a running vulkfmd instead of a local engine\n");
+	printf("  -g dir     write golden reference renders to dir\n");
+	printf("  -c dir     check every render mode against the goldens in dir\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+	int rate = 44100;
+	int loops = 1;
+	int cacheMB = 0;
+	const char* outPath = nullptr;
+	EKernelLevel kernelLevel = KernelBest;
+	const char* goldenWrite = nullptr;
+	const char* goldenCheck = nullptr;
+
+	int argi = 1;
+	bool checkAlloc = false;
+	bool stems = false;
+	bool latency = false;
+	double latencySeconds = 0;
+	int bufferFrames = 800;
+	const char* daemon = nullptr;
+	float reference = 0;
+	const char* tunings[8];
+	int tuningCount = 0;
+	for(; argi < argc && argv[argi][0] == '-'; ++argi) {
+		if(argv[argi][1] == 'a') { checkAlloc = true; continue; }
+		if(argv[argi][1] == 's') { stems = true; continue; }
+		if(argv[argi][1] == 't') { latency = true; continue; }
+		if(argi+1 >= argc) { usage(); return 1; }
+		switch(argv[argi][1]) {
+		case 'r': rate = atoi(argv[++argi]); break;
+		case 'o': outPath = argv[++argi]; break;
+		case 'n': loops = atoi(argv[++argi]); break;
+		case 'm': cacheMB = atoi(argv[++argi]); break;
+		case 'g': goldenWrite = argv[++argi]; break;
+		case 'c': goldenCheck = argv[++argi]; break;
+		case 'l': latencySeconds = atof(argv[++argi]); break;
+		case 'b': bufferFrames = atoi(argv[++argi]); break;
+		case 'd': daemon = argv[++argi]; break;
+		case 'p': reference = (float)atof(argv[++argi]); break;
+		case 'u':
+			if(tuningCount == 8) { usage(); return 1; }
+			tunings[tuningCount++] = argv[++argi];
+			break;
+		case 'k':
+			++argi;
+			for(int i = 0; i < KernelLevelCount; ++i) {
+				if(strcmp(argv[argi], kernelLevelName((EKernelLevel)i)) == 0)
+					kernelLevel = (EKernelLevel)i;
+			}
+			break;
+		default: usage(); return 1;
+		}
+	}
+
+	if(goldenWrite)
+		return writeGoldens(goldenWrite) ? 0 : 1;
+
+	if(goldenCheck) {
+		int failures = checkGoldens(goldenCheck);
+#if defined(__linux__)
+		failures += check_server();
+#endif
+		printf("%d failures\n", failures);
+		return failures ? 1 : 0;
+	}
+
+	if(latencySeconds > 0) {
+		if(rate <= 0 || bufferFrames <= 0 || getKernels(kernelLevel) == nullptr) {
+			usage();
+			return 1;
+		}
+		return run_latency(rate, bufferFrames, latencySeconds, kernelLevel);
+	}
+
+	if(daemon) {
+#if defined(__linux__)
+		if(argi + 1 == argc)
+			return run_client(daemon, argv[argi], outPath);
+#else
+		printf("vulkfmd is linux only\n");
+#endif
+		usage();
+		return 1;
+	}
+
+	if(argi >= argc || rate <= 0 || loops <= 0 || (stems && outPath == nullptr)) {
+		usage();
+		return 1;
+	}
+
+	const Kernels* kernels = getKernels(kernelLevel);
+	if(kernels == nullptr) {
+		printf("kernels %s not supported on this cpu\n", kernelLevelName(kernelLevel));
+		return 1;
+	}
+	printf("using %s kernels\n", kernels->name);
+
+	// Checked once here, every loop sets up a new engine with it.
+	Tuning tuning;
+	if(reference > 0)
+		tuning.setReference(reference);
+	for(int i = 0; i < tuningCount; ++i) {
+		if(!tuning.loadFile(tunings[i])) {
+			printf("%s: could not load tuning\n", tunings[i]);
+			return 1;
+		}
+	}
+
+	// With stems midi channel n plays on bus n which goes to output n, the
+	// mix is the sum of the outputs. Without, everything goes to output 0.
+	const int outputs = stems ? MAX_CHANNELS : 1;
+	static float block[MAX_CHANNELS*2][BLOCK_SIZE];
+	static float mix[2][BLOCK_SIZE];
+	float* outs[MAX_CHANNELS*2];
+	for(int c = 0; c < outputs*2; ++c)
+		outs[c] = block[c];
+	double totalAudio = 0;
+	double totalRender = 0;
+	int failed = 0;
+
+	for(; argi < argc; ++argi) {
+		const char* path = argv[argi];
+		size_t size = 0;
+		uint8_t* data = load_file(path, &size);
+		if(data == nullptr) {
+			printf("%s: could not read file\n", path);
+			failed++;
+			continue;
+		}
+
+		for(int loop = 0; loop < loops; ++loop) {
+			VulkFMConfig config;
+			config.outputs = outputs;
+			config.noteCacheBytes = (size_t)cacheMB << 20;
+			VulkFM synth(config);
+			synth.setKernels(kernels->level);
+			if(reference > 0)
+				synth.getTuning()->setReference(reference);
+			for(int i = 0; i < tuningCount; ++i)
+				synth.getTuning()->loadFile(tunings[i]);
+			LatencyProbe probe(latency ? 1 << 16 : 0);
+			if(latency)
+				synth.setLatencyProbe(&probe);
+			MidiPlayer player(&synth, (float)rate);
+			player.setQueued(latency);		// the probe times the event queue
+			if(!player.load(data, size)) {
+				printf("%s: not a type 0/1 midi file\n", path);
+				failed++;
+				break;
+			}
+
+			FILE* wav = nullptr;
+			FILE* stemWav[MAX_CHANNELS] = {};
+			char stemPath[MAX_CHANNELS][512];
+			float peak[MAX_CHANNELS] = {};
+			if(outPath && loop == 0) {
+				wav = wav_open(outPath, rate, 2);
+				for(int o = 0; o < outputs && stems; ++o) {
+					snprintf(stemPath[o], sizeof(stemPath[o]), "%s.ch%d.wav", outPath, o+1);
+					stemWav[o] = wav_open(stemPath[o], rate, 2);
+				}
+			}
+			for(int b = 0; b < synth.getBusCount() && stems; ++b)
+				synth.getBus(b)->output = b;
+
+			auto start = std::chrono::steady_clock::now();
+			int frames;
+			allocCount = 0;
+			do {
+				allocGuard = checkAlloc;
+				frames = player.renderOutputs(outs, BLOCK_SIZE);
+				if(latency)
+					probe.delivered(synth.getFramesRendered());
+				allocGuard = false;
+				if(wav && stems) {
+					memset(mix, 0, sizeof(mix));
+					for(int o = 0; o < outputs; ++o) {
+						for(int i = 0; i < frames; ++i) {
+							mix[0][i] += block[o*2][i];
+							mix[1][i] += block[o*2+1][i];
+							float a = fabsf(block[o*2][i]) + fabsf(block[o*2+1][i]);
+							peak[o] = a > peak[o] ? a : peak[o];
+						}
+						if(stemWav[o])
+							wav_write(stemWav[o], block[o*2], block[o*2+1], frames);
+					}
+					wav_write(wav, mix[0], mix[1], frames);
+				}
+				else if(wav) {
+					wav_write(wav, block[0], block[1], frames);
+				}
+			} while(frames == BLOCK_SIZE);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			if(allocCount > 0) {
+				printf("%s: %lu allocations on the render path\n", path, allocCount);
+				failed++;
+			}
+
+			if(wav) {
+				wav_close(wav);
+				for(int o = 0; o < outputs && stems; ++o) {
+					if(stemWav[o] == nullptr)
+						continue;
+					wav_close(stemWav[o]);
+					if(peak[o] == 0.f)
+						remove(stemPath[o]);		// channel not used
+				}
+				outPath = nullptr;
+			}
+
+			double seconds = player.position() / (double)rate;
+			totalAudio += seconds;
+			totalRender += elapsed.count();
+
+			printf("%s: %llu events, %.2fs audio in %.3fs, %.1fx realtime\n",
+				path,
+				(unsigned long long)player.eventCount(),
+				seconds,
+				elapsed.count(),
+				elapsed.count() > 0 ? seconds/elapsed.count() : 0.0);
+
+			if(latency)
+				probe.report(stdout);
+
+			if(cacheMB > 0) {
+				const NoteCacheStats& st = synth.getNoteCacheStats();
+				printf("  note cache: %llu hits, %llu misses, %llu evictions, %llu divergences, %d notes in %.1f of %.1f MB\n",
+					(unsigned long long)st.hits,
+					(unsigned long long)st.misses,
+					(unsigned long long)st.evictions,
+					(unsigned long long)st.divergences,
+					st.entries,
+					st.bytesUsed / 1048576.0,
+					st.bytes / 1048576.0);
+			}
+		}
+		free(data);
+	}
+
+	if(totalRender > 0)
+		printf("total: %.2fs audio in %.3fs, %.1fx realtime\n", totalAudio, totalRender, totalAudio/totalRender);
+
+	return failed ? 1 : 0;
+}
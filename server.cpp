@@ -0,0 +1,709 @@
+
+#include "server.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <new>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+
+static void signal_fd(int fd)
+{
+	uint64_t one = 1;
+	if(write(fd, &one, sizeof(one)) < 0) {
+		// Counter saturated, the other side has wakeups pending anyway
+	}
+}
+
+static void drain_fd(int fd)
+{
+	uint64_t count;
+	while(read(fd, &count, sizeof(count)) > 0) {}
+}
+
+static void close_fd(int& fd)
+{
+	if(fd >= 0)
+		::close(fd);
+	fd = -1;
+}
+
+// blockFrames and blocks are each side's own copy, the header is writable by
+// both and the server can't trust it.
+static float* slot_samples(ServerRing* ring, int blockFrames, int blocks, uint64_t block, ServerSlot** slot)
+{
+	uint8_t* p = (uint8_t*)ring + ServerRing::slotOffset() + ServerRing::slotBytes(blockFrames)*(block % blocks);
+	*slot = (ServerSlot*)p;
+	return (float*)(p + 64);
+}
+
+
+bool serverSocketPath(char* path, size_t size)
+{
+	const char* runtime = getenv("XDG_RUNTIME_DIR");
+	if(runtime != nullptr && runtime[0] != 0)
+		return snprintf(path, size, "%s/vulkfm.sock", runtime) < (int)size;
+
+	// /tmp is shared, the socket goes in a directory only this user can enter.
+	char dir[64];
+	snprintf(dir, sizeof(dir), "/tmp/vulkfm-%u", (unsigned)geteuid());
+	if(mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return false;
+	struct stat st;
+	if(lstat(dir, &st) < 0)
+		return false;
+	if(!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+		errno = EACCES;
+		return false;
+	}
+	return snprintf(path, size, "%s/vulkfm.sock", dir) < (int)size;
+}
+
+
+RenderServer::RenderServer()
+: synth_(nullptr)
+, listen_(-1)
+, running_(false)
+, frame_(0)
+{
+	path_[0] = 0;
+}
+
+RenderServer::~RenderServer()
+{
+	close();
+}
+
+bool RenderServer::open(const char* path, const ServerConfig& config)
+{
+	close();
+	config_ = config;
+	if(config_.blockFrames < 1)
+		config_.blockFrames = 1;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	// Only a socket nobody answers on is left over from a daemon that didn't
+	// exit cleanly, anything else at the path stays.
+	struct stat st;
+	if(lstat(path, &st) == 0) {
+		if(!S_ISSOCK(st.st_mode)) {
+			errno = EEXIST;
+			return false;
+		}
+		int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		const bool live = probe >= 0 && ::connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+		close_fd(probe);
+		if(live) {
+			errno = EADDRINUSE;
+			return false;
+		}
+		unlink(path);
+	}
+
+	listen_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(listen_ < 0)
+		return false;
+	if(bind(listen_, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_, SERVER_MAX_CLIENTS) < 0) {
+		close_fd(listen_);
+		return false;
+	}
+	strcpy(path_, path);
+
+	// Channel n -> bus n -> output n, one output per client.
+	VulkFMConfig engine = config_.engine;
+	engine.buses = MAX_CHANNELS;
+	engine.outputs = SERVER_MAX_CLIENTS;
+	synth_ = new VulkFM(engine);
+	for(int b = 0; b < synth_->getBusCount(); ++b)
+		synth_->getBus(b)->output = b;
+	frame_ = 0;
+	return true;
+}
+
+void RenderServer::close()
+{
+	for(int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+		if(clients_[i].sock >= 0)
+			disconnect(clients_[i], i);
+	}
+	if(listen_ >= 0) {
+		close_fd(listen_);
+		unlink(path_);
+	}
+	delete synth_;
+	synth_ = nullptr;
+}
+
+
+void RenderServer::run()
+{
+	typedef std::chrono::steady_clock clock;
+	const clock::duration period = std::chrono::duration_cast<clock::duration>(
+		std::chrono::duration<double>(config_.blockFrames / (double)config_.rate));
+	clock::time_point next = clock::now();
+
+	// poll entries: listen socket, then a socket and a space eventfd per client
+	struct pollfd fds[1 + 2*SERVER_MAX_CLIENTS];
+	int owner[1 + 2*SERVER_MAX_CLIENTS];
+
+	running_ = true;
+	while(running_) {
+		int count = 0;
+		fds[count].fd = listen_;
+		fds[count].events = POLLIN;
+		owner[count++] = -1;
+		for(int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+			const Client& c = clients_[i];
+			if(c.sock < 0)
+				continue;
+			fds[count].fd = c.sock;
+			fds[count].events = POLLIN;
+			owner[count++] = i;
+			if(c.space >= 0) {
+				fds[count].fd = c.space;
+				fds[count].events = POLLIN;
+				owner[count++] = i;
+			}
+		}
+
+		int timeout = -1;
+		if(config_.realTime) {
+			auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - clock::now()).count();
+			timeout = wait > 0 ? (int)wait : 0;
+		}
+		else if(canRender()) {
+			timeout = 0;
+		}
+
+		if(poll(fds, count, timeout) < 0 && errno != EINTR)
+			break;
+
+		for(int f = 0; f < count; ++f) {
+			if(fds[f].revents == 0)
+				continue;
+			if(owner[f] < 0) {
+				accept();
+				continue;
+			}
+			Client& c = clients_[owner[f]];
+			if(fds[f].fd == c.space)
+				drain_fd(c.space);
+			else if(fds[f].fd == c.sock && !receive(c, owner[f]))
+				disconnect(c, owner[f]);
+		}
+
+		// Rendering starts after the sockets are drained, a client sends the
+		// commands for a block before it frees the slot for it.
+		if(config_.realTime) {
+			const clock::time_point now = clock::now();
+			if(now - next > period*SERVER_MAX_RING)
+				next = now;		// stalled, don't try to catch up
+			while(now >= next && running_) {
+				renderBlock();
+				next += period;
+			}
+		}
+		else if(canRender()) {
+			renderBlock();
+		}
+	}
+}
+
+
+void RenderServer::accept()
+{
+	int sock;
+	while((sock = accept4(listen_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		// Same user only, the engine is shared by every client.
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+		if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != geteuid()) {
+			::close(sock);
+			continue;
+		}
+		int i = 0;
+		while(i < SERVER_MAX_CLIENTS && clients_[i].sock >= 0)
+			++i;
+		if(i == SERVER_MAX_CLIENTS) {
+			ServerWelcome full;
+			::send(sock, &full, sizeof(full), MSG_NOSIGNAL);
+			::close(sock);
+			continue;
+		}
+		clients_[i].sock = sock;
+	}
+}
+
+// All messages waiting on the socket. False when the client is gone or broke
+// the protocol.
+bool RenderServer::receive(Client& c, int channel)
+{
+	for(;;) {
+		uint8_t buf[64];
+		const ssize_t r = recv(c.sock, buf, sizeof(buf), MSG_DONTWAIT);
+		if(r < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		if(r == 0)
+			return false;
+
+		if(!c.hello) {
+			ServerHello hello;
+			if(r != sizeof(hello))
+				return false;
+			memcpy(&hello, buf, sizeof(hello));
+			if(hello.magic != SERVER_MAGIC || hello.type != MsgHello || hello.version != SERVER_VERSION)
+				return false;
+			if(!welcome(c, channel, hello))
+				return false;
+			continue;
+		}
+
+		ServerCommand cmd;
+		if(r != sizeof(cmd))
+			return false;
+		memcpy(&cmd, buf, sizeof(cmd));
+		if(cmd.type == MsgStart) {
+			if(!c.started) {
+				c.started = true;
+				c.startFrame = frame_;
+			}
+		}
+		else {
+			enqueue(c, channel, cmd);
+		}
+	}
+}
+
+// Ring memory and eventfds go to the client with the welcome.
+bool RenderServer::welcome(Client& c, int channel, const ServerHello& hello)
+{
+	int blocks = hello.ringBlocks;
+	blocks = blocks < 2 ? 2 : (blocks > SERVER_MAX_RING ? SERVER_MAX_RING : blocks);
+	const size_t bytes = ServerRing::bytes(config_.blockFrames, blocks);
+
+	int mem = memfd_create("vulkfm-ring", MFD_CLOEXEC);
+	if(mem < 0 || ftruncate(mem, bytes) < 0) {
+		close_fd(mem);
+		return false;
+	}
+	void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, mem, 0);
+	if(p == MAP_FAILED) {
+		close_fd(mem);
+		return false;
+	}
+	c.ring = new (p) ServerRing();
+	c.ringBytes = bytes;
+	c.ready = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	c.space = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(c.ready < 0 || c.space < 0) {
+		close_fd(mem);
+		return false;		// disconnect cleans up
+	}
+
+	c.ring->blockFrames = config_.blockFrames;
+	c.ring->blocks = blocks;
+	c.blocks = blocks;
+	c.written = 0;
+	c.hello = true;
+
+	ServerWelcome w;
+	w.ringBlocks = (uint16_t)blocks;
+	w.rate = config_.rate;
+	w.blockFrames = config_.blockFrames;
+	w.ringBytes = (uint32_t)bytes;
+	w.channel = channel;
+
+	int fds[3] = { mem, c.ready, c.space };
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = { &w, sizeof(w) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	const bool ok = sendmsg(c.sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(w);
+	close_fd(mem);		// the mapping keeps the memory
+	return ok;
+}
+
+// Insertion from the back, commands mostly come in order. A full queue
+// applies the command right away rather than losing a note off.
+void RenderServer::enqueue(Client& c, int channel, const ServerCommand& cmd)
+{
+	if(c.queued == SERVER_QUEUE) {
+		if(c.ring)
+			c.ring->late++;
+		apply(c, channel, cmd);
+		return;
+	}
+	int i = c.queued++;
+	while(i > 0 && c.queue[i-1].frame > cmd.frame) {
+		c.queue[i] = c.queue[i-1];
+		--i;
+	}
+	c.queue[i] = cmd;
+}
+
+void RenderServer::apply(Client& c, int channel, const ServerCommand& cmd)
+{
+	const int note = cmd.note & 0x7f;
+	Instrument* inst = synth_->getInstrument(0);
+	OperatorConf& op = inst->opConf_[cmd.op < MAX_OPERATORS ? cmd.op : 0];
+	const float v = cmd.value;
+
+	switch(cmd.type) {
+	case MsgNoteOn:
+		synth_->trigger(note, channel, cmd.velocity & 0x7f);
+		c.held[note >> 6] |= 1ull << (note & 63);
+		break;
+	case MsgNoteOff:
+		synth_->release(note, channel, 0);
+		c.held[note >> 6] &= ~(1ull << (note & 63));
+		break;
+	case MsgPatch:
+		switch(cmd.param) {
+		case ParamGain:			inst->gain = v; break;
+		case ParamPan:			inst->pan = v; break;
+		case ParamVelocitySens:	inst->velocitySens = v; break;
+		case ParamUnison:		inst->unison = v < 1 ? 1 : (v > config_.engine.maxUnison ? config_.engine.maxUnison : (int)v); break;
+		case ParamUnisonDetune:	inst->unisonDetune = v; break;
+		case ParamAlgorithm:	inst->setAlgorithm(v >= 1 ? &dx7_1Algo : &defaultAlgorithm); break;	// kept while all programs play
+		case ParamFreqScale:	op.freqScale = v; break;
+		case ParamOscAmp:		op.oscAmp = v; break;
+		case ParamWaveform:		op.oscWaveform = (EWaveForm)(v < 0 ? 0 : (v > AbsSine ? AbsSine : (int)v)); break;
+		case ParamAttackLevel:	op.env.attackLevel = v; break;
+		case ParamAttack:		op.env.attack = v; break;
+		case ParamDecay:		op.env.decay = v; break;
+		case ParamSustain:		op.env.sustain = v; break;
+		case ParamRelease:		op.env.release = v; break;
+		default: break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	// Apply right away so a dense chord can't overflow the event queue.
+	synth_->processEvents();
+}
+
+void RenderServer::disconnect(Client& c, int channel)
+{
+	for(int note = 0; note < 128; ++note) {
+		if(c.held[note >> 6] & (1ull << (note & 63))) {
+			synth_->release(note, channel, 0);
+			synth_->processEvents();
+		}
+	}
+	if(c.ring)
+		munmap(c.ring, c.ringBytes);
+	close_fd(c.sock);
+	close_fd(c.ready);
+	close_fd(c.space);
+	c.ring = nullptr;
+	c.ringBytes = 0;
+	c.hello = false;
+	c.started = false;
+	c.startFrame = 0;
+	c.held[0] = c.held[1] = 0;
+	c.queued = 0;
+	c.blocks = 0;
+	c.written = 0;
+}
+
+
+// Blocks written and not yet consumed, -1 when the client moved its read
+// counter somewhere it can't be.
+int RenderServer::unread(const Client& c) const
+{
+	const uint64_t r = c.ring->read.load(std::memory_order_acquire);
+	if(r > c.written || c.written - r > (uint64_t)c.blocks)
+		return -1;
+	return (int)(c.written - r);
+}
+
+// Disconnects clients with a broken ring on the way.
+bool RenderServer::canRender()
+{
+	bool any = false;
+	bool room = true;
+	for(int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+		Client& c = clients_[i];
+		if(!c.started)
+			continue;
+		const int u = unread(c);
+		if(u < 0) {
+			disconnect(c, i);
+			continue;
+		}
+		room &= u < c.blocks;
+		any = true;
+	}
+	return any && room;
+}
+
+// Engine frame of the earliest queued command of a started client.
+uint64_t RenderServer::nextCommand() const
+{
+	uint64_t next = UINT64_MAX;
+	for(const Client& c : clients_) {
+		if(c.started && c.queued > 0 && c.startFrame + c.queue[0].frame < next)
+			next = c.startFrame + c.queue[0].frame;
+	}
+	return next;
+}
+
+// One block into the ring of every started client with room, split at
+// command frames.
+void RenderServer::renderBlock()
+{
+	const int n = config_.blockFrames;
+	const float dt = 1.f/config_.rate;
+	float* outs[2*SERVER_MAX_CLIENTS];
+	float* run[2*SERVER_MAX_CLIENTS];
+
+	for(int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+		Client& c = clients_[i];
+		outs[2*i] = outs[2*i+1] = nullptr;
+		if(!c.started)
+			continue;
+		const int u = unread(c);
+		if(u < 0) {
+			disconnect(c, i);
+			continue;
+		}
+		if(u == c.blocks) {
+			c.ring->dropped++;
+			continue;
+		}
+		ServerSlot* slot;
+		outs[2*i] = slot_samples(c.ring, n, c.blocks, c.written, &slot);
+		outs[2*i+1] = outs[2*i] + n;
+		slot->frame = frame_ - c.startFrame;
+	}
+
+	int done = 0;
+	while(done < n) {
+		const uint64_t now = frame_ + done;
+		for(int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+			Client& c = clients_[i];
+			if(!c.started)
+				continue;
+			int k = 0;
+			for(; k < c.queued && c.startFrame + c.queue[k].frame <= now; ++k) {
+				if(c.startFrame + c.queue[k].frame < now)
+					c.ring->late++;
+				apply(c, i, c.queue[k]);
+			}
+			if(k > 0) {
+				memmove(c.queue, c.queue + k, sizeof(ServerCommand)*(c.queued - k));
+				c.queued -= k;
+			}
+		}
+
+		const uint64_t next = nextCommand();
+		const int frames = next - now < (uint64_t)(n - done) ? (int)(next - now) : n - done;
+		for(int o = 0; o < 2*SERVER_MAX_CLIENTS; ++o)
+			run[o] = outs[o] ? outs[o] + done : nullptr;
+		synth_->renderOutputs(run, frames, dt);
+		done += frames;
+	}
+	frame_ += n;
+
+	for(int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+		Client& c = clients_[i];
+		if(outs[2*i] == nullptr)
+			continue;
+		c.ring->written.store(++c.written, std::memory_order_release);
+		signal_fd(c.ready);
+	}
+}
+
+
+ServerClient::ServerClient()
+: sock_(-1)
+, ready_(-1)
+, space_(-1)
+, ring_(nullptr)
+, ringBytes_(0)
+, ringBlocks_(0)
+, rate_(0)
+, blockFrames_(0)
+{
+}
+
+ServerClient::~ServerClient()
+{
+	close();
+}
+
+bool ServerClient::connect(const char* path, int ringBlocks)
+{
+	close();
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return false;
+	strcpy(addr.sun_path, path);
+
+	sock_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(sock_ < 0 || ::connect(sock_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close();
+		return false;
+	}
+
+	ServerHello hello;
+	hello.ringBlocks = (uint16_t)ringBlocks;
+	if(::send(sock_, &hello, sizeof(hello), MSG_NOSIGNAL) != (ssize_t)sizeof(hello)) {
+		close();
+		return false;
+	}
+
+	ServerWelcome w;
+	int fds[3] = { -1, -1, -1 };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { &w, sizeof(w) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	const ssize_t r = recvmsg(sock_, &msg, MSG_CMSG_CLOEXEC);
+	struct cmsghdr* cm = r == (ssize_t)sizeof(w) ? CMSG_FIRSTHDR(&msg) : nullptr;
+	if(cm != nullptr && cm->cmsg_type == SCM_RIGHTS && cm->cmsg_len == CMSG_LEN(sizeof(fds)))
+		memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+	ready_ = fds[1];
+	space_ = fds[2];
+	if(fds[0] < 0 || w.magic != SERVER_MAGIC || w.ringBlocks == 0) {
+		close_fd(fds[0]);
+		close();
+		return false;
+	}
+
+	void* p = mmap(nullptr, w.ringBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close_fd(fds[0]);
+	if(p == MAP_FAILED) {
+		close();
+		return false;
+	}
+	ring_ = (ServerRing*)p;
+	ringBytes_ = w.ringBytes;
+	ringBlocks_ = w.ringBlocks;
+	rate_ = w.rate;
+	blockFrames_ = w.blockFrames;
+	return true;
+}
+
+void ServerClient::close()
+{
+	if(ring_)
+		munmap(ring_, ringBytes_);
+	ring_ = nullptr;
+	ringBytes_ = 0;
+	close_fd(sock_);
+	close_fd(ready_);
+	close_fd(space_);
+}
+
+bool ServerClient::send(const ServerCommand& cmd)
+{
+	return sock_ >= 0 && ::send(sock_, &cmd, sizeof(cmd), MSG_NOSIGNAL) == (ssize_t)sizeof(cmd);
+}
+
+bool ServerClient::start()
+{
+	ServerCommand cmd = {};
+	cmd.type = MsgStart;
+	return send(cmd);
+}
+
+bool ServerClient::noteOn(uint64_t frame, int note, int velocity)
+{
+	ServerCommand cmd = {};
+	cmd.type = MsgNoteOn;
+	cmd.note = (uint8_t)note;
+	cmd.velocity = (uint8_t)velocity;
+	cmd.frame = frame;
+	return send(cmd);
+}
+
+bool ServerClient::noteOff(uint64_t frame, int note)
+{
+	ServerCommand cmd = {};
+	cmd.type = MsgNoteOff;
+	cmd.note = (uint8_t)note;
+	cmd.frame = frame;
+	return send(cmd);
+}
+
+bool ServerClient::patch(uint64_t frame, EServerParam param, int op, float value)
+{
+	ServerCommand cmd = {};
+	cmd.type = MsgPatch;
+	cmd.param = param;
+	cmd.op = (uint8_t)op;
+	cmd.value = value;
+	cmd.frame = frame;
+	return send(cmd);
+}
+
+// The socket only becomes readable when the server closes it.
+const float* ServerClient::acquire(uint64_t* frame, int timeoutMs)
+{
+	if(ring_ == nullptr)
+		return nullptr;
+	for(;;) {
+		const uint64_t r = ring_->read.load(std::memory_order_relaxed);
+		if(ring_->written.load(std::memory_order_acquire) > r) {
+			ServerSlot* slot;
+			const float* samples = slot_samples(ring_, blockFrames_, ringBlocks_, r, &slot);
+			if(frame)
+				*frame = slot->frame;
+			return samples;
+		}
+
+		struct pollfd fds[2] = { { ready_, POLLIN, 0 }, { sock_, POLLIN, 0 } };
+		const int p = poll(fds, 2, timeoutMs);
+		if(p < 0 && errno == EINTR)
+			continue;
+		if(p <= 0 || fds[1].revents)
+			return nullptr;
+		drain_fd(ready_);
+	}
+}
+
+void ServerClient::release()
+{
+	if(ring_ == nullptr)
+		return;
+	ring_->read.fetch_add(1, std::memory_order_release);
+	signal_fd(space_);
+}
@@ -0,0 +1,238 @@
+#if !defined(SERVER_H_)
+#define SERVER_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include "vulkfm.h"
+
+// Render daemon, Linux only. One engine serves up to SERVER_MAX_CLIENTS local
+// clients over a SOCK_SEQPACKET Unix domain socket. Client n plays on midi
+// channel n, which mixes on bus n to output n, and the engine renders that
+// output straight into the client's shared memory ring. Every slot of the
+// ring is one block; an eventfd each way signals a written and a consumed
+// block.
+//
+// Commands are timestamped in frames of the client's stream, frame 0 being
+// the first frame of the first block after MsgStart. Rendering is split
+// at command frames so they land on the exact sample, commands that arrive
+// after their frame was rendered are applied at the next block and counted
+// as late.
+//
+// By default the engine renders a block as soon as every started client has
+// room for it, so the clients' consumption is the clock and nothing is lost.
+// In real time mode a timer is the clock and a block is dropped for a client
+// whose ring is full.
+//
+// Only processes of the daemon's own user are served.
+
+#define SERVER_MAGIC 0x44464b56		// "VKFD"
+#define SERVER_VERSION 1
+#define SERVER_MAX_CLIENTS MAX_CHANNELS
+#define SERVER_MAX_RING 64			// blocks
+#define SERVER_QUEUE 1024			// pending commands per client
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "ring counters are shared between processes");
+
+enum EServerMsg : uint8_t
+{
+	MsgHello,		// client -> server, first message
+	MsgWelcome,		// server -> client, with the ring memfd and eventfds
+	MsgStart,		// stream starts at the next block
+	MsgNoteOn,
+	MsgNoteOff,
+	MsgPatch,
+};
+
+// Patch parameters, on the instrument all clients share. Operator parameters
+// take the operator index.
+enum EServerParam : uint8_t
+{
+	ParamGain,
+	ParamPan,
+	ParamVelocitySens,
+	ParamUnison,
+	ParamUnisonDetune,
+	ParamAlgorithm,			// 0 default, 1 dx7 algorithm 1, sounding notes keep theirs
+	ParamFreqScale,
+	ParamOscAmp,
+	ParamWaveform,			// EWaveForm
+	ParamAttackLevel,
+	ParamAttack,
+	ParamDecay,
+	ParamSustain,
+	ParamRelease,
+	ParamCount,
+};
+
+struct ServerHello
+{
+	uint32_t magic = SERVER_MAGIC;
+	uint8_t type = MsgHello;
+	uint8_t version = SERVER_VERSION;
+	uint16_t ringBlocks = 8;
+};
+
+struct ServerWelcome
+{
+	uint32_t magic = SERVER_MAGIC;
+	uint8_t type = MsgWelcome;
+	uint8_t version = SERVER_VERSION;
+	uint16_t ringBlocks = 0;		// 0 when the server is full
+	uint32_t rate = 0;
+	uint32_t blockFrames = 0;
+	uint32_t ringBytes = 0;
+	uint32_t channel = 0;
+};
+
+struct ServerCommand
+{
+	uint8_t type;			// EServerMsg
+	uint8_t note;
+	uint8_t velocity;
+	uint8_t op;
+	uint8_t param;			// EServerParam
+	uint8_t pad[3];
+	uint64_t frame;
+	float value;
+};
+
+// Head of the shared memory, slots follow at ServerRing::slotOffset. A slot
+// is a ServerSlot then blockFrames left and blockFrames right samples. The
+// client can write all of it, the server keeps its own written count and
+// sizes and drops a client whose read counter leaves [written-blocks, written].
+struct ServerRing
+{
+	std::atomic<uint64_t> written;		// blocks, server side
+	std::atomic<uint64_t> read;			// blocks, client side
+	std::atomic<uint64_t> dropped;		// blocks lost to a full ring
+	std::atomic<uint64_t> late;			// commands applied after their frame
+	uint32_t blockFrames;
+	uint32_t blocks;
+
+	static size_t slotOffset() { return 64; }
+	static size_t slotBytes(int blockFrames) { return 64 + sizeof(float)*2*blockFrames; }
+	static size_t bytes(int blockFrames, int blocks) { return slotOffset() + slotBytes(blockFrames)*blocks; }
+};
+
+struct ServerSlot
+{
+	uint64_t frame;			// stream frame of the first sample
+};
+
+
+struct ServerConfig
+{
+	VulkFMConfig engine;
+	int rate = 44100;
+	int blockFrames = 256;
+	bool realTime = false;
+};
+
+
+// Default socket, $XDG_RUNTIME_DIR/vulkfm.sock or vulkfm.sock in a /tmp
+// directory private to the user, created if missing. False with errno set
+// when that directory isn't the user's alone.
+bool serverSocketPath(char* path, size_t size);
+
+
+class RenderServer
+{
+public:
+	RenderServer();
+	~RenderServer();
+
+	// Creates the engine and listens on path, replacing a stale socket there.
+	// False with errno set, EADDRINUSE when a daemon answers on path.
+	bool open(const char* path, const ServerConfig& config);
+	void close();
+
+	// Serves clients until stop(), which may be called from a signal handler.
+	void run();
+	void stop() { running_ = false; }
+
+	VulkFM* engine() { return synth_; }
+
+protected:
+	struct Client {
+		int sock = -1;
+		int ready = -1;			// eventfd, block written
+		int space = -1;			// eventfd, block consumed
+		ServerRing* ring = nullptr;
+		size_t ringBytes = 0;
+		int blocks = 0;				// server copies, the ring header isn't trusted
+		uint64_t written = 0;
+		bool hello = false;
+		bool started = false;
+		uint64_t startFrame = 0;	// engine frame of stream frame 0
+		uint64_t held[2] = {};		// notes on, released on disconnect
+
+		// Sorted by frame.
+		ServerCommand queue[SERVER_QUEUE];
+		int queued = 0;
+	};
+
+	void accept();
+	bool receive(Client& c, int channel);
+	bool welcome(Client& c, int channel, const ServerHello& hello);
+	void enqueue(Client& c, int channel, const ServerCommand& cmd);
+	void apply(Client& c, int channel, const ServerCommand& cmd);
+	void disconnect(Client& c, int channel);
+	int unread(const Client& c) const;
+	bool canRender();
+	void renderBlock();
+	uint64_t nextCommand() const;
+
+	ServerConfig config_;
+	VulkFM* synth_;
+	int listen_;
+	char path_[108];
+	volatile bool running_;
+	uint64_t frame_;			// engine frames rendered
+	Client clients_[SERVER_MAX_CLIENTS];
+};
+
+
+// Client side of the protocol, for hosts. Not thread safe, one thread sends
+// commands and consumes blocks.
+class ServerClient
+{
+public:
+	ServerClient();
+	~ServerClient();
+
+	bool connect(const char* path, int ringBlocks = 8);
+	void close();
+
+	bool start();
+	bool noteOn(uint64_t frame, int note, int velocity);
+	bool noteOff(uint64_t frame, int note);
+	bool patch(uint64_t frame, EServerParam param, int op, float value);
+
+	// Waits for the next block, left then right blockFrames() samples in the
+	// shared memory. Valid until release(), nullptr on timeout or when the
+	// server is gone.
+	const float* acquire(uint64_t* frame, int timeoutMs = -1);
+	void release();
+
+	int rate() const			{ return rate_; }
+	int blockFrames() const		{ return blockFrames_; }
+	int ringBlocks() const		{ return ring_ ? ringBlocks_ : 0; }
+	uint64_t consumed() const	{ return ring_ ? ring_->read.load(std::memory_order_relaxed) : 0; }
+	uint64_t dropped() const	{ return ring_ ? ring_->dropped.load(std::memory_order_relaxed) : 0; }
+	uint64_t late() const		{ return ring_ ? ring_->late.load(std::memory_order_relaxed) : 0; }
+
+protected:
+	bool send(const ServerCommand& cmd);
+
+	int sock_;
+	int ready_;
+	int space_;
+	ServerRing* ring_;
+	size_t ringBytes_;
+	int ringBlocks_;
+	int rate_;
+	int blockFrames_;
+};
+
+#endif
@@ -0,0 +1,346 @@
+
+#include "tuning.h"
+#include "vulkfm.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+
+// Frequency of MIDI note 0, what .tun cents count from by default.
+#define TUN_BASE_FREQ 8.1757989156437073336
+
+
+// Copies the next line without its line end to line, truncated to size-1.
+// False at the end of the text.
+static bool next_line(const char*& p, const char* end, char* line, int size)
+{
+	if(p >= end)
+		return false;
+	int len = 0;
+	while(p < end && *p != '\n') {
+		if(*p != '\r' && len < size-1)
+			line[len++] = *p;
+		++p;
+	}
+	if(p < end)
+		++p;
+	line[len] = 0;
+	return true;
+}
+
+static const char* skip_space(const char* s)
+{
+	while(*s == ' ' || *s == '\t')
+		++s;
+	return s;
+}
+
+// Integer floor division, degrees and keys below the root go down an octave.
+static int floor_div(int a, int b)
+{
+	return a >= 0 ? a/b : -((-a + b - 1)/b);
+}
+
+
+Tuning::Tuning()
+: reference_(TUNING_REFERENCE)
+, referenceNote_(TUNING_REFERENCE_NOTE)
+, degrees_(0)
+, mapSize_(-1)
+, firstNote_(0)
+, lastNote_(TUNING_NOTES-1)
+, middleNote_(TUNING_REFERENCE_NOTE - 9)
+, octaveDegree_(0)
+, table_(false)
+, serial_(0)
+{
+	memset(cents_, 0, sizeof(cents_));
+	memset(map_, 0, sizeof(map_));
+	memset(tableFreq_, 0, sizeof(tableFreq_));
+	update();
+}
+
+void Tuning::setReference(float hz, int note)
+{
+	if(!(hz > 0.f) || note < 0 || note >= TUNING_NOTES)
+		return;
+	reference_ = hz;
+	referenceNote_ = note;
+	if(mapSize_ < 0)
+		middleNote_ = note - 9;
+	update();
+}
+
+void Tuning::setEqual()
+{
+	degrees_ = 0;
+	mapSize_ = -1;
+	middleNote_ = referenceNote_ - 9;
+	table_ = false;
+	update();
+}
+
+
+// Header, step count, then one pitch per line: cents when it has a period,
+// otherwise a ratio n/d or a whole number.
+bool Tuning::loadScala(const char* text, size_t size)
+{
+	const char* p = text;
+	const char* end = text + size;
+	char line[256];
+	double cents[TUNING_MAX_DEGREES];
+	int count = -1;
+	int read = 0;
+	bool description = false;
+
+	while((count < 0 || read < count) && next_line(p, end, line, sizeof(line))) {
+		if(line[0] == '!')
+			continue;
+		if(!description) {
+			description = true;
+			continue;
+		}
+		const char* s = skip_space(line);
+		if(count < 0) {
+			count = atoi(s);
+			if(count < 1 || count > TUNING_MAX_DEGREES)
+				return false;
+			continue;
+		}
+
+		size_t len = strcspn(s, " \t");
+		char* e;
+		double v;
+		if(memchr(s, '.', len) != nullptr) {
+			v = strtod(s, &e);
+		}
+		else {
+			const double num = (double)strtol(s, &e, 10);
+			double den = 1.0;
+			if(*e == '/')
+				den = (double)strtol(e + 1, &e, 10);
+			if(num <= 0 || den <= 0)
+				return false;
+			v = 1200.0*log2(num/den);
+		}
+		if(e == s)
+			return false;
+		cents[read++] = v;
+	}
+	if(count < 0 || read < count || cents[count-1] <= 0)
+		return false;
+
+	memcpy(cents_, cents, sizeof(double)*count);
+	degrees_ = count;
+	table_ = false;
+	update();
+	return true;
+}
+
+// Size, first, last and middle note, reference note and frequency, octave
+// degree, then size degrees with x for keys that don't play.
+bool Tuning::loadKeyboardMap(const char* text, size_t size)
+{
+	const char* p = text;
+	const char* end = text + size;
+	char line[256];
+	double head[7];
+	int map[TUNING_NOTES];
+	int values = 0;
+	int mapped = 0;
+
+	while(next_line(p, end, line, sizeof(line))) {
+		if(line[0] == '!')
+			continue;
+		const char* s = skip_space(line);
+		if(values < 7) {
+			char* e;
+			head[values] = strtod(s, &e);
+			if(e == s)
+				return false;
+			if(++values == 7 && (head[0] < 0 || head[0] > TUNING_NOTES))
+				return false;
+			continue;
+		}
+		if(mapped == (int)head[0])
+			break;
+		if(*s == 'x' || *s == 'X')
+			map[mapped++] = -1;
+		else if(isdigit((unsigned char)*s) || *s == '-')
+			map[mapped++] = atoi(s);
+		else
+			return false;
+	}
+	if(values < 7 || mapped < (int)head[0] || head[5] <= 0 || head[4] < 0 || head[4] >= TUNING_NOTES)
+		return false;
+
+	mapSize_ = (int)head[0];
+	firstNote_ = (int)head[1];
+	lastNote_ = (int)head[2];
+	middleNote_ = (int)head[3];
+	referenceNote_ = (int)head[4];
+	reference_ = (float)head[5];
+	octaveDegree_ = (int)head[6];
+	memcpy(map_, map, sizeof(int)*mapSize_);
+	table_ = false;
+	update();
+	return true;
+}
+
+// [Tuning] or [Exact Tuning] sections of "note n = cents" above BaseFreq,
+// the exact one wins. Notes left out keep 100 cents per key.
+bool Tuning::loadTun(const char* text, size_t size)
+{
+	const char* p = text;
+	const char* end = text + size;
+	char line[256];
+	double cents[2][TUNING_NOTES];
+	bool any[2] = { false, false };
+	double base = TUN_BASE_FREQ;
+	int section = -1;		// 0 tuning, 1 exact tuning
+
+	for(int n = 0; n < TUNING_NOTES; ++n)
+		cents[0][n] = cents[1][n] = 100.0*n;
+
+	while(next_line(p, end, line, sizeof(line))) {
+		for(char* c = line; *c; ++c)
+			*c = (char)tolower((unsigned char)*c);
+		const char* s = skip_space(line);
+		if(*s == ';' || *s == 0)
+			continue;
+		if(*s == '[') {
+			section = strncmp(s, "[tuning]", 8) == 0 ? 0 : (strncmp(s, "[exact tuning]", 14) == 0 ? 1 : -1);
+			continue;
+		}
+		const char* eq = strchr(s, '=');
+		if(section < 0 || eq == nullptr)
+			continue;
+		if(strncmp(s, "note", 4) == 0) {
+			const int n = atoi(s + 4);
+			if(n >= 0 && n < TUNING_NOTES) {
+				cents[section][n] = strtod(eq + 1, nullptr);
+				any[section] = true;
+			}
+		}
+		else if(strncmp(s, "basefreq", 8) == 0) {
+			base = strtod(eq + 1, nullptr);
+		}
+	}
+	if((!any[0] && !any[1]) || !(base > 0))
+		return false;
+
+	const double* c = any[1] ? cents[1] : cents[0];
+	for(int n = 0; n < TUNING_NOTES; ++n)
+		tableFreq_[n] = (float)(base*pow(2.0, c[n]/1200.0));
+	table_ = true;
+	update();
+	return true;
+}
+
+bool Tuning::loadFile(const char* path)
+{
+	const char* ext = strrchr(path, '.');
+	if(ext == nullptr)
+		return false;
+	char e[8] = {};
+	for(int i = 0; i < 7 && ext[i]; ++i)
+		e[i] = (char)tolower((unsigned char)ext[i]);
+
+	FILE* f = fopen(path, "rb");
+	if(f == nullptr)
+		return false;
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char* text = len > 0 ? (char*)malloc(len) : nullptr;
+	bool ok = text != nullptr && fread(text, 1, len, f) == (size_t)len;
+	fclose(f);
+
+	if(ok && strcmp(e, ".scl") == 0)
+		ok = loadScala(text, len);
+	else if(ok && strcmp(e, ".kbm") == 0)
+		ok = loadKeyboardMap(text, len);
+	else if(ok && strcmp(e, ".tun") == 0)
+		ok = loadTun(text, len);
+	else
+		ok = false;
+	free(text);
+	return ok;
+}
+
+
+// Cents of any degree, whole periods above or below the scale.
+double Tuning::degreeCents(int degree) const
+{
+	if(degrees_ == 0)
+		return 100.0*degree;		// keyboard mapping without a scale
+	const int period = floor_div(degree, degrees_);
+	const int step = degree - period*degrees_;
+	return period*cents_[degrees_-1] + (step > 0 ? cents_[step-1] : 0.0);
+}
+
+// Cents above the middle note, false for keys that don't play.
+bool Tuning::noteCents(int note, double* cents) const
+{
+	const int offset = note - middleNote_;
+	if(mapSize_ <= 0) {
+		*cents = degreeCents(offset);
+		return true;
+	}
+	if(note < firstNote_ || note > lastNote_)
+		return false;
+	const int repeat = floor_div(offset, mapSize_);
+	const int degree = map_[offset - repeat*mapSize_];
+	if(degree < 0)
+		return false;
+	const int octave = octaveDegree_ > 0 ? octaveDegree_ : (degrees_ > 0 ? degrees_ : 12);
+	*cents = repeat*degreeCents(octave) + degreeCents(degree);
+	return true;
+}
+
+// Equal temperament keeps the expression the engine always used, so renders
+// at the default tuning don't change.
+void Tuning::update()
+{
+	float freq[TUNING_NOTES];
+	if(table_) {
+		memcpy(freq, tableFreq_, sizeof(freq));
+	}
+	else if(degrees_ == 0 && mapSize_ < 0) {
+		for(int n = 0; n < TUNING_NOTES; ++n)
+			freq[n] = reference_ * powf(ACONST, (float)(n - referenceNote_));
+	}
+	else {
+		// An unmapped reference key still sets the pitch, as if it were mapped linearly.
+		double ref;
+		if(!noteCents(referenceNote_, &ref))
+			ref = degreeCents(referenceNote_ - middleNote_);
+		for(int n = 0; n < TUNING_NOTES; ++n) {
+			double c;
+			freq[n] = noteCents(n, &c) ? (float)(reference_*pow(2.0, (c - ref)/1200.0)) : 0.f;
+		}
+	}
+
+	const uint32_t serial = serial_.load(std::memory_order_relaxed);
+	serial_.store(serial + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for(int n = 0; n < TUNING_NOTES; ++n)
+		freq_[n].store(freq[n], std::memory_order_relaxed);
+	serial_.store(serial + 2, std::memory_order_release);
+}
+
+uint32_t Tuning::copyTable(float* freq) const
+{
+	for(;;) {
+		const uint32_t serial = serial_.load(std::memory_order_acquire);
+		if(serial & 1)
+			continue;
+		for(int n = 0; n < TUNING_NOTES; ++n)
+			freq[n] = freq_[n].load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(serial_.load(std::memory_order_relaxed) == serial)
+			return serial;
+	}
+}
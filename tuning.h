@@ -0,0 +1,79 @@
+#if !defined(TUNING_H_)
+#define TUNING_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+
+// Frequency of every note. 12 tone equal temperament from a reference pitch
+// by default. A Scala scale (.scl) replaces the steps, mapped linearly from 9
+// keys below the reference note unless a keyboard mapping (.kbm) is loaded;
+// a mapping without a scale maps the 12 equal steps. An AnaMark .tun file
+// gives every note its own frequency. Changes are made
+// on the control thread and picked up by the engine on the next note-on, the
+// table is published under a sequence lock so a reader never sees half of it.
+
+#define TUNING_NOTES 128
+#define TUNING_MAX_DEGREES 256
+#define TUNING_REFERENCE 432.f		// Hz, default pitch of the reference note
+#define TUNING_REFERENCE_NOTE 57	// A
+
+class Tuning
+{
+public:
+	Tuning();
+
+	// Pitch of one note, the scale and mapping are kept.
+	void setReference(float hz, int note = TUNING_REFERENCE_NOTE);
+	float reference() const		{ return reference_; }
+	int referenceNote() const	{ return referenceNote_; }
+
+	// False and unchanged when the text doesn't parse. A keyboard mapping
+	// brings its own reference, a .tun table ignores scale and reference.
+	bool loadScala(const char* text, size_t size);
+	bool loadKeyboardMap(const char* text, size_t size);
+	bool loadTun(const char* text, size_t size);
+	bool loadFile(const char* path);	// by extension, .scl .kbm or .tun
+
+	// Back to equal temperament at the current reference.
+	void setEqual();
+
+	// 0 for notes the keyboard mapping leaves out, they don't play.
+	float frequency(int note) const	{ return freq_[note & (TUNING_NOTES-1)].load(std::memory_order_relaxed); }
+
+	// Changes with every change of the table, never 0.
+	uint32_t serial() const { return serial_.load(std::memory_order_acquire) & ~1u; }
+
+	// All TUNING_NOTES frequencies as of one serial, which is returned. Safe
+	// on any thread, retries while the control thread writes the table.
+	uint32_t copyTable(float* freq) const;
+
+protected:
+	void update();
+	double degreeCents(int degree) const;
+	bool noteCents(int note, double* cents) const;
+
+	float reference_;
+	int referenceNote_;
+
+	// Scale steps above the root in cents, the last is the period. None for
+	// 12 tone equal temperament.
+	double cents_[TUNING_MAX_DEGREES];
+	int degrees_;
+
+	// Keyboard mapping, mapSize_ < 0 without one, 0 maps linearly.
+	int mapSize_;
+	int firstNote_;
+	int lastNote_;
+	int middleNote_;
+	int octaveDegree_;
+	int map_[TUNING_NOTES];			// scale degree, -1 unmapped
+
+	bool table_;					// .tun loaded
+	float tableFreq_[TUNING_NOTES];
+
+	std::atomic<float> freq_[TUNING_NOTES];
+	std::atomic<uint32_t> serial_;		// odd while freq_ is written
+};
+
+#endif
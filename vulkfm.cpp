@@ -1,21 +1,22 @@
 
 #include "vulkfm.h"
+#include "analyzer.h"
+#include "latency.h"
 
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <cassert>
-
-#define TIN_FOIL
-
-#define A4 440.f
-#if defined(TIN_FOIL)
-	#undef A4
-	#define A4 432.f
+#include <cstdlib>
+#include <new>
+#if defined(_WIN32)
+#include <malloc.h>
 #endif
 
 #define TAU (float)(2*M_PI)
+#define VOICE_LEVEL 0.7f
+#define MASTER_GAIN 0.3f
 
 static inline float clamp01f(float v) { return (v<0?0:(v>1.f?1.0f:v)); }
 
@@ -60,9 +61,27 @@ void Osc::update(float time)
 		phase_ -= TAU;
 }
 
+void Osc::renderPhase(float* phase, int n, float time)
+{
+	const float inc = time * freq_ * TAU;
+	float p = phase_;
+	for(int i = 0; i < n; ++i) {
+		phase[i] = p;
+		p += inc;
+		while(p > TAU)
+			p -= TAU;
+	}
+	phase_ = p;
+}
+
 float Osc::evaluate(float fmodulation) const
 {
-	float a = phase_ + fmodulation;
+	return evaluateAt(phase_, fmodulation);
+}
+
+float Osc::evaluateAt(float phase, float fmodulation) const
+{
+	float a = phase + fmodulation;
 	float sample = 0.f; 
 
 	switch(opConf_->oscWaveform) {
@@ -78,10 +97,37 @@ float Osc::evaluate(float fmodulation) const
 
 Env::Env() : level_(0), state_(4) { }
 
-void Env::trigger( const EnvConf* _envConf) { envConf_ = _envConf; state_ = 0; }
-void Env::retrigger() { state_ = 0; }
+void Env::trigger( const EnvConf* _envConf) { envConf_ = _envConf; level_ = 0; state_ = 0; }
+
+// Events that land after the voice already rendered past them take back the
+// part of the current stage since the event and run the new one for it instead.
+void Env::retrigger(float lead)
+{
+	rewind(lead);
+	state_ = 0;
+	if(lead > 0)
+		update(lead);
+}
+
+void Env::release(float lead)
+{
+	rewind(lead);
+	state_ = 3;
+	if(lead > 0)
+		update(lead);
+}
 
-void Env::release() { state_ = 3; }
+void Env::rewind(float time)
+{
+	if(time <= 0)
+		return;
+	if(state_ == 0 && envConf_->attack > 0)
+		level_ -= time*(1.f/envConf_->attack);
+	else if(state_ == 1 && envConf_->decay > 0)
+		level_ += time*(1.f/envConf_->decay);
+	if(level_ < 0)
+		level_ = 0;
+}
 
 bool Env::update(float dt)
 {
@@ -129,13 +175,23 @@ bool Env::update(float dt)
 
 float Env::evaluate() const { return level_; }
 
-Operator::Operator() { }
+bool Env::render(float* level, int n, float dt)
+{
+	bool playing = state_ < 4;
+	for(int i = 0; i < n; ++i) {
+		level[i] = level_;
+		playing = update(dt);
+	}
+	return playing;
+}
+
+Operator::Operator() : conf_(nullptr) { }
 
-void Operator::trigger(float freq, const OperatorConf *conf) { osc_.trigger(freq*conf->freqScale, conf); env_.trigger(&conf->env); }
+void Operator::trigger(float freq, const OperatorConf *conf) { conf_ = conf; osc_.trigger(freq, conf); env_.trigger(&conf->env); }
 
-void Operator::retrigger() { env_.retrigger(); }
+void Operator::retrigger(float lead) { env_.retrigger(lead); }
 
-void Operator::release() { env_.release(); }
+void Operator::release(float lead) { env_.release(lead); }
 
 bool Operator::update(float deltaTime)
 {
@@ -151,11 +207,64 @@ float Operator::evaluate(float modulation) const
 	return e*sample;
 }
 
+float Operator::evaluateAt(float phase, float modulation) const
+{
+	float sample = osc_.evaluateAt(phase, modulation);
+	float e = env_.evaluate();
+	return e*sample;
+}
+
+void Operator::saveState(float* s) const
+{
+	s[0] = osc_.phase();
+	s[1] = env_.evaluate();
+	s[2] = (float)env_.state();
+}
+
+void Operator::loadState(const float* s)
+{
+	osc_.setPhase(s[0]);
+	env_.setState(s[1], (int)s[2]);
+}
+
+void Instrument::initPrograms(InstrumentProgram* pool, int count)
+{
+	for(int i = 0; i < count; ++i)
+		new (&pool[i]) InstrumentProgram();
+	programs_ = pool;
+	programCount_ = count;
+	program_ = pool;	// empty until a patch is set, plays nothing
+}
+
+bool Instrument::setAlgorithm(const Algorithm* _algo)
+{
+	OpGraph graph;
+	algorithmToGraph(*_algo, graph);
+	if(!setGraph(graph))
+		return false;
+	algo_ = _algo;
+	return true;
+}
+
+bool Instrument::setGraph(const OpGraph& graph)
+{
+	InstrumentProgram* free = nullptr;
+	for(int i = 0; i < programCount_ && free == nullptr; ++i)
+		free = programs_[i].voices == 0 ? &programs_[i] : nullptr;
+	CompiledAlgorithm prog;
+	if(free == nullptr || !compileGraph(graph, prog))
+		return false;
+	copyCompiled(free->compiled, prog);
+	program_ = free;
+	algo_ = nullptr;
+	return true;
+}
+
 //
 int Instrument::serialize(uint8_t* buffer, int maxSize) const
 {
 	int bytesWritten = 0;
-	if(maxSize > 100) {
+	if(maxSize > 100 && algo_ != nullptr) {
 		// Start with algorithm
 		buffer[bytesWritten++] = 'A';
 		buffer[bytesWritten++] = (uint8_t)algo_->operatorCount;
@@ -185,62 +294,174 @@ int Instrument::serialize(uint8_t* buffer, int maxSize) const
 
 Voice::Voice()
 : inst_(nullptr)
+, prog_(nullptr)
 , opCount_(0)
+, maxOps_(0)
+, note_(0)
 , active_(false)
+, ops_(nullptr)
+, outs_(nullptr)
+, bus_(0)
+, channel_(0)
+, gainLeft_(1.f)
+, gainRight_(1.f)
+, lanes_(1)
+, maxLanes_(1)
+, laneGain_(1.f)
+, lanePhase_(nullptr)
+, laneOut_(nullptr)
+{
+}
+
+// laneState holds 2 * maxOps * maxLanes floats
+void Voice::init(Operator* ops, float* outs, int maxOps, float* laneState, int maxLanes)
 {
-	for(int i = 0; i < OP_COUNT; ++i)
+	ops_ = ops;
+	outs_ = outs;
+	maxOps_ = maxOps;
+	for(int i = 0; i < maxOps_; ++i)
 		outs_[i] = 0;
+
+	maxLanes_ = maxLanes;
+	lanePhase_ = laneState;
+	laneOut_ = laneState + maxOps*maxLanes;
 }
 
+// Take over the state of another voice, used to keep active voices packed.
+void Voice::copyFrom(const Voice& other)
+{
+	inst_ = other.inst_;
+	prog_ = other.prog_;	// other leaves the active range, the count moves here
+	opCount_ = other.opCount_;
+	note_ = other.note_;
+	active_ = other.active_;
+	memcpy(ops_, other.ops_, sizeof(Operator)*opCount_);
+	memcpy(outs_, other.outs_, sizeof(float)*opCount_);
+	cached_ = other.cached_;
+	rate_ = other.rate_;
+	latencyId_ = other.latencyId_;
+	bus_ = other.bus_;
+	channel_ = other.channel_;
+	gainLeft_ = other.gainLeft_;
+	gainRight_ = other.gainRight_;
+
+	lanes_ = other.lanes_;
+	laneGain_ = other.laneGain_;
+	if(lanes_ > 1) {
+		memcpy(laneRatio_, other.laneRatio_, sizeof(float)*lanes_);
+		memcpy(lanePhase_, other.lanePhase_, sizeof(float)*opCount_*lanes_);
+		memcpy(laneOut_, other.laneOut_, sizeof(float)*opCount_*lanes_);
+	}
+}
 
-void Voice::trigger(int _note, const Instrument* _inst)
+
+void Voice::releaseProgram()
 {
-	this->inst_ = _inst;
-	opCount_ = _inst->algo_->operatorCount;
-	int freqDiff = _note-57; // Midi note 57 is A4 (440Hz)
+	if(prog_ != nullptr)
+		prog_->voices--;
+	prog_ = nullptr;
+}
 
-	float baseFreq = A4 * powf( ACONST, (float)freqDiff);
+void Voice::trigger(int _note, int velocity, const Instrument* _inst, const float* opFreq, const float* laneRatio)
+{
+	prog_ = nullptr;	// a voice from the pool holds nothing
+	if(_inst->program().operatorCount > maxOps_) {
+		active_ = false;
+		return;
+	}
+
+	this->inst_ = _inst;
+	note_ = _note;
+	prog_ = _inst->program_;
+	prog_->voices++;
+	opCount_ = prog_->compiled.operatorCount;
 
 	for(int i = 0; i < opCount_; ++i) {
-		ops_[i].trigger(baseFreq, &_inst->opConf_[i]);
+		ops_[i].trigger(opFreq[i], &_inst->opConf_[i]);
+		outs_[i] = 0;
+	}
+
+	lanes_ = _inst->unison < 1 ? 1 : (_inst->unison > maxLanes_ ? maxLanes_ : _inst->unison);
+	laneGain_ = 1.f/sqrtf((float)lanes_);
+	if(lanes_ > 1) {
+		// Copies spread evenly over the phase spread, detune is precomputed.
+		for(int l = 0; l < lanes_; ++l) {
+			laneRatio_[l] = laneRatio[l];
+			float phase = _inst->unisonPhaseSpread * TAU * l / lanes_;
+			while(phase > TAU)
+				phase -= TAU;
+			for(int i = 0; i < opCount_; ++i) {
+				lanePhase_[i*lanes_ + l] = phase;
+				laneOut_[i*lanes_ + l] = 0.f;
+			}
+		}
 	}
+	setLevel(velocity);
+	rate_ = VoiceRate();
 	active_ = true;
 }
 
-void Voice::retrigger()
+void Voice::retrigger(int velocity, float lead)
 {
 	for(int i = 0; i < opCount_; ++i) {		
-		ops_[i].retrigger();
+		ops_[i].retrigger(lead);
 	}	
+	setLevel(velocity);
+}
+
+// Constant power pan scaled to unity at center, hard left or right is +3dB.
+void Voice::setLevel(int velocity)
+{
+	const float sens = clamp01f(inst_->velocitySens);
+	const float level = VOICE_LEVEL * inst_->gain * (1.f - sens + sens*velocity/127.f);
+	const float pan = inst_->pan < -1.f ? -1.f : (inst_->pan > 1.f ? 1.f : inst_->pan);
+	const double angle = (pan + 1.0) * M_PI/4;
+	gainLeft_ = level * (float)(cos(angle)*M_SQRT2);
+	gainRight_ = level * (float)(sin(angle)*M_SQRT2);
 }
 
-void Voice::release()
+void Voice::release(float lead)
 {
 	for(int i = 0; i < opCount_; ++i)
-		ops_[i].release();
+		ops_[i].release(lead);
 }
 
 float Voice::evaluate()
 { 
 	float output = 0;
-	if(active_) {
-		const Algorithm* algo = inst_->algo_;
-		int count = 0;
-		for(int i = opCount_ -1; i >= 0; --i) {
-			float modulation = 0;
-			uint8_t modFlags = algo->mods[i];
-			if( modFlags!= 0) {
-				for(int m = opCount_ -1; m >= i; --m) {
-					if(modFlags&(1u<<m)) {
-						modulation += outs_[m];
-					}
-				}
+	if(active_ && lanes_ > 1) {
+		const CompiledAlgorithm& prog = prog_->compiled;
+		for(int k = 0; k < opCount_; ++k) {
+			const OpInstr& in = prog.instr[k];
+			const OpInput* inputs = prog.fanin + in.faninStart;
+			for(int l = 0; l < lanes_; ++l) {
+				float modulation = 0;
+				for(int m = 0; m < in.faninCount; ++m)
+					modulation += laneOut_[inputs[m].op*lanes_ + l] * inputs[m].depth;
+
+				float v = ops_[in.op].evaluateAt(lanePhase_[in.op*lanes_ + l], modulation);
+				laneOut_[in.op*lanes_ + l] = v;
+				if(in.output) output += v;
 			}
-			outs_[i] = ops_[i].evaluate(modulation);
+		}
+		if(prog.outputCount > 0)
+			output = output * laneGain_/prog.outputCount;
+	}
+	else if(active_) {
+		const CompiledAlgorithm& prog = prog_->compiled;
+		for(int k = 0; k < opCount_; ++k) {
+			const OpInstr& in = prog.instr[k];
+			const OpInput* inputs = prog.fanin + in.faninStart;
+			float modulation = 0;
+			for(int m = 0; m < in.faninCount; ++m)
+				modulation += outs_[inputs[m].op] * inputs[m].depth;
 
-			if(algo->outs & (1u<<i)) { output += outs_[i]; count++; }
+			float v = ops_[in.op].evaluate(modulation);
+			outs_[in.op] = v;
+			if(in.output) output += v;
 		}
-		output = output * 1.f/count;
+		if(prog.outputCount > 0)
+			output = output * 1.f/prog.outputCount;
 	}
 	return output;
 }
@@ -250,120 +471,544 @@ bool Voice::update(float dt)
 	bool playing = false;
 
 	if( active_ ) {
-		const uint8_t outs = inst_->algo_->outs;
+		const bool* outs = prog_->compiled.isOutput;
 		for(int i = 0; i < opCount_; ++i) {
-			playing |= ops_[i].update(dt) && (outs&(1u<<i));
+			playing |= ops_[i].update(dt) && outs[i];
+		}
+
+		for(int i = 0; i < opCount_ && lanes_ > 1; ++i) {
+			const float inc = dt * ops_[i].frequency() * TAU;
+			for(int l = 0; l < lanes_; ++l) {
+				float& phase = lanePhase_[i*lanes_ + l];
+				phase += inc * laneRatio_[l];
+				while(phase > TAU)
+					phase -= TAU;
+			}
 		}
 		active_ = playing;
 	}
 	return playing;
 }
 
+bool Voice::renderBlock(float* out, int n, float dt, const Kernels& k, float* scratch)
+{
+	if(!active_)
+		return false;
+
+	const CompiledAlgorithm& prog = prog_->compiled;
+	if(prog.cyclic) {
+		// Feedback loops through several operators, has to go sample by sample.
+		return renderSamples(out, n, dt);
+	}
+
+	if(lanes_ > 1)
+		return renderLanes(out, n, dt, k, scratch);
+
+	float* phase = scratch;
+	float* env = phase + RENDER_BLOCK;
+	float* mod = env + RENDER_BLOCK;
+	float* opOut = mod + RENDER_BLOCK*maxLanes_;
+
+	memset(out, 0, sizeof(float)*n);
+	bool playing = false;
+
+	for(int i = 0; i < opCount_; ++i) {
+		const OpInstr& in = prog.instr[i];
+		const OpInput* inputs = prog.fanin + in.faninStart;
+		float* dst = opOut + in.op*RENDER_BLOCK;
+
+		memset(mod, 0, sizeof(float)*n);
+		for(int m = 0; m < in.faninCount; ++m) {
+			if(inputs[m].op != in.op)
+				k.addScaled(mod, opOut + inputs[m].op*RENDER_BLOCK, inputs[m].depth, n);
+		}
+
+		Operator& op = ops_[in.op];
+		const OperatorConf* conf = op.conf();
+		op.renderPhase(phase, n, dt);
+		bool envPlaying = op.renderEnv(env, n, dt);
+
+		if(in.selfDepth != 0.f) {
+			k.oscFeedback(dst, phase, mod, env, conf->oscAmp, conf->oscWaveform, in.selfDepth, &outs_[in.op], n);
+		}
+		else {
+			k.osc(dst, phase, mod, env, conf->oscAmp, conf->oscWaveform, n);
+			outs_[in.op] = dst[n-1];
+		}
+
+		if(in.output) {
+			k.addScaled(out, dst, 1.f, n);
+			playing |= envPlaying;
+		}
+	}
+
+	if(prog.outputCount > 0)
+		k.scale(out, 1.f/prog.outputCount, n);
+
+	active_ = playing;
+	return playing;
+}
+
+const float* Voice::blockOutputs(const float* scratch) const
+{
+	if(prog_->compiled.cyclic || lanes_ > 1)
+		return nullptr;
+	return scratch + RENDER_BLOCK*(2 + maxLanes_);
+}
+
+// Per operator phase, envelope level and state and last output, then the
+// unison lane phases and outputs and the upsampler.
+void Voice::saveState(float* s) const
+{
+	for(int i = 0; i < opCount_; ++i, s += 4) {
+		ops_[i].saveState(s);
+		s[3] = outs_[i];
+	}
+	if(lanes_ > 1) {
+		memcpy(s, lanePhase_, sizeof(float)*opCount_*lanes_);
+		memcpy(s + opCount_*lanes_, laneOut_, sizeof(float)*opCount_*lanes_);
+		s += 2*opCount_*lanes_;
+	}
+	if(rate_.factor > 1)
+		memcpy(s, &rate_, sizeof(VoiceRate));
+}
+
+void Voice::loadState(const float* s)
+{
+	for(int i = 0; i < opCount_; ++i, s += 4) {
+		ops_[i].loadState(s);
+		outs_[i] = s[3];
+	}
+	if(lanes_ > 1) {
+		memcpy(lanePhase_, s, sizeof(float)*opCount_*lanes_);
+		memcpy(laneOut_, s + opCount_*lanes_, sizeof(float)*opCount_*lanes_);
+		s += 2*opCount_*lanes_;
+	}
+	if(rate_.factor > 1)
+		memcpy((void*)&rate_, s, sizeof(VoiceRate));
+	active_ = true;
+}
+
+// Carson's rule, an operator reaches its own frequency plus (index + 1) times
+// the top frequency of each modulator, the index being depth times the peak
+// modulator level. Only sines are band limited, and strong self-feedback
+// turns into a sawtooth.
+float Voice::bandwidth() const
+{
+	const CompiledAlgorithm& prog = prog_->compiled;
+	if(prog.cyclic)
+		return INFINITY;
+
+	float top[MAX_OPERATORS];
+	float result = 0.f;
+	for(int k = 0; k < opCount_; ++k) {
+		const OpInstr& in = prog.instr[k];
+		const OpInput* inputs = prog.fanin + in.faninStart;
+		const OperatorConf* conf = ops_[in.op].conf();
+		if(conf->oscWaveform != Sine)
+			return INFINITY;
+
+		const float freq = ops_[in.op].frequency();
+		float t = freq;
+		for(int m = 0; m < in.faninCount; ++m) {
+			const OperatorConf* mod = ops_[inputs[m].op].conf();
+			const float peak = fabsf(mod->oscAmp) * (mod->env.attackLevel > mod->env.sustain ? mod->env.attackLevel : mod->env.sustain);
+			const float index = fabsf(inputs[m].depth) * peak;
+			if(index == 0.f)
+				continue;
+			if(inputs[m].op == in.op) {
+				if(index > 1.f)
+					return INFINITY;
+				t += (index + 1.f) * freq;
+			}
+			else {
+				t += (index + 1.f) * top[inputs[m].op];
+			}
+		}
+		top[in.op] = t;
+		if(in.output && t > result)
+			result = t;
+	}
+
+	if(lanes_ > 1)
+		result *= laneRatio_[lanes_-1];
+	return result;
+}
+
+bool Voice::renderSamples(float* out, int n, float dt)
+{
+	bool playing = active_;
+	for(int i = 0; i < n; ++i) {
+		out[i] = evaluate();
+		playing = update(dt);
+	}
+	return playing;
+}
+
+// Unison path, each operator runs all its copies as vector lanes. The envelope
+// is stepped once per operator and shared by the copies.
+bool Voice::renderLanes(float* out, int n, float dt, const Kernels& k, float* scratch)
+{
+	const CompiledAlgorithm& prog = prog_->compiled;
+	const int lanes = lanes_;
+	const int stride = RENDER_BLOCK*lanes;
+
+	float* env = scratch + RENDER_BLOCK;
+	float* mod = env + RENDER_BLOCK;
+	float* opOut = mod + RENDER_BLOCK*maxLanes_;
+	float inc[MAX_UNISON];
+
+	memset(out, 0, sizeof(float)*n);
+	bool playing = false;
+
+	for(int i = 0; i < opCount_; ++i) {
+		const OpInstr& in = prog.instr[i];
+		const OpInput* inputs = prog.fanin + in.faninStart;
+		float* dst = opOut + in.op*stride;
+
+		memset(mod, 0, sizeof(float)*n*lanes);
+		for(int m = 0; m < in.faninCount; ++m) {
+			if(inputs[m].op != in.op)
+				k.addScaled(mod, opOut + inputs[m].op*stride, inputs[m].depth, n*lanes);
+		}
+
+		Operator& op = ops_[in.op];
+		const OperatorConf* conf = op.conf();
+		bool envPlaying = op.renderEnv(env, n, dt);
+
+		const float baseInc = dt * op.frequency() * TAU;
+		for(int l = 0; l < lanes; ++l)
+			inc[l] = baseInc * laneRatio_[l];
+
+		k.oscLanes(dst, lanePhase_ + in.op*lanes, inc, mod, env, conf->oscAmp, conf->oscWaveform,
+			in.selfDepth, laneOut_ + in.op*lanes, lanes, n);
+
+		if(in.output) {
+			k.sumLanes(out, dst, 1.f, lanes, n);
+			playing |= envPlaying;
+		}
+	}
+
+	if(prog.outputCount > 0)
+		k.scale(out, laneGain_/prog.outputCount, n);
+
+	active_ = playing;
+	return playing;
+}
+
 //---------------------------------------------------
 
-VulkFM::VulkFM()
+static inline size_t align_up(size_t v) { return (v + 63) & ~(size_t)63; }
+
+static void* arena_alloc(size_t size)
 {
-	outBufferIdx_ = 0;
-	voices_ = 32;
-	voicePool_ = new Voice*[voices_];
-	activeVoices_ = new ActiveVoice[voices_];
+#if defined(_WIN32)
+	return _aligned_malloc(size, 64);
+#else
+	return aligned_alloc(64, size);
+#endif
+}
 
-	for(int i = 0; i < voices_; ++i)
-		voicePool_[i] = new Voice();
-	poolCount_ = voices_;
+static void arena_free(void* p)
+{
+#if defined(_WIN32)
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+static double besselI0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	for(int k = 1; k < 32; ++k) {
+		term *= (x/(2*k)) * (x/(2*k));
+		sum += term;
+	}
+	return sum;
+}
+
+// Polyphase windowed sinc, phase p of factor f interpolates p/f of an internal
+// sample past in[k - RATE_TAPS/2]. Cutoff at the internal Nyquist frequency,
+// the Kaiser window gives around 60 dB image rejection from 3/4 of the
+// internal rate. Phase 0 passes samples through unchanged.
+static void designUpsampler(float* coeffs, int factor)
+{
+	const double beta = 5.65;
+	const double half = RATE_TAPS/2;
+	for(int p = 0; p < factor; ++p) {
+		float* c = coeffs + p*RATE_TAPS;
+		double h[RATE_TAPS];
+		double sum = 0;
+		for(int j = 0; j < RATE_TAPS; ++j) {
+			double u = j - half + (double)p/factor;
+			double r = u/half;
+			double sinc = u == 0 ? 1.0 : sin(M_PI*u)/(M_PI*u);
+			double w = r*r < 1.0 ? besselI0(beta*sqrt(1.0 - r*r))/besselI0(beta) : 0.0;
+			h[j] = sinc*w;
+			sum += h[j];
+		}
+		for(int j = 0; j < RATE_TAPS; ++j)
+			c[j] = (float)(h[j]/sum);
+	}
+}
+
+VulkFM::VulkFM(const VulkFMConfig& config)
+{
+	outBufferIdx_ = 0;
+	voiceCount_ = config.polyphony;
 	activeCount_ = 0;
+	maxInstrumentCount_ = config.maxInstruments;
+	const int maxOps = config.maxOperators;
+	const int maxLanes = config.maxUnison < 1 ? 1 : (config.maxUnison > MAX_UNISON ? MAX_UNISON : config.maxUnison);
+	maxOps_ = maxOps;
+	maxLanes_ = maxLanes;
+	const int laneFloats = 2 * maxOps * maxLanes;
+	const int programCount = config.instrumentPrograms < 1 ? 1 : config.instrumentPrograms;
+	const int voiceScratch = Voice::voiceScratchSize(maxOps, maxLanes);
+	busCount_ = config.buses < 1 ? 1 : config.buses;
+	outputCount_ = config.outputs < 1 ? 1 : (config.outputs > MAX_OUTPUTS ? MAX_OUTPUTS : config.outputs);
+
+	size_t voiceBytes = align_up(sizeof(Voice) * voiceCount_);
+	size_t opBytes = align_up(sizeof(Operator) * maxOps * voiceCount_);
+	size_t outBytes = align_up(sizeof(float) * maxOps * voiceCount_);
+	size_t laneBytes = align_up(sizeof(float) * laneFloats * voiceCount_);
+	size_t instBytes = align_up(sizeof(Instrument) * maxInstrumentCount_) + align_up(sizeof(TunedNotes) * maxInstrumentCount_)
+		+ align_up(sizeof(float) * TUNING_NOTES * maxOps * maxInstrumentCount_)
+		+ align_up(sizeof(InstrumentProgram) * programCount * maxInstrumentCount_);
+	size_t busBytes = align_up(sizeof(BusConf) * busCount_) + align_up(sizeof(bool) * busCount_);
+	effectCount_ = config.effects < 0 ? 0 : config.effects;
+	const size_t effectFloats = EffectUnit::memoryFloats(config.effectMaxRate);
+	size_t scratchBytes = align_up(sizeof(float) * (voiceScratch + 8*RENDER_BLOCK + 2*RENDER_BLOCK*(busCount_ + outputCount_)
+		+ EffectUnit::scratchFloats() + 2*RENDER_BLOCK*(1 + effectCount_)));
+	size_t cacheBytes = NoteCache::memorySize(config.noteCacheBytes);
+	size_t effectBytes = align_up(sizeof(EffectConf) * effectCount_) + align_up(sizeof(EffectUnit) * effectCount_)
+		+ align_up(sizeof(EEffectUse) * effectCount_) + align_up(sizeof(float) * effectFloats * effectCount_);
+	arenaSize_ = align_up(voiceBytes + opBytes + outBytes + laneBytes + instBytes + busBytes + scratchBytes + cacheBytes + effectBytes);
+
+	arena_ = arena_alloc(arenaSize_);
+	assert(arena_ != nullptr);
+	memset(arena_, 0, arenaSize_);
+
+	uint8_t* mem = (uint8_t*)arena_;
+	voices_ = (Voice*)mem;
+	Operator* ops = (Operator*)(mem + voiceBytes);
+	float* outs = (float*)(mem + voiceBytes + opBytes);
+	float* laneState = (float*)(mem + voiceBytes + opBytes + outBytes);
+	instrumentList_ = (Instrument*)(mem + voiceBytes + opBytes + outBytes + laneBytes);
+	tuned_ = (TunedNotes*)((uint8_t*)instrumentList_ + align_up(sizeof(Instrument) * maxInstrumentCount_));
+	float* tunedFreq = (float*)((uint8_t*)tuned_ + align_up(sizeof(TunedNotes) * maxInstrumentCount_));
+	InstrumentProgram* programs = (InstrumentProgram*)((uint8_t*)tunedFreq + align_up(sizeof(float) * TUNING_NOTES * maxOps * maxInstrumentCount_));
+	busConf_ = (BusConf*)(mem + voiceBytes + opBytes + outBytes + laneBytes + instBytes);
+	busActive_ = (bool*)((uint8_t*)busConf_ + align_up(sizeof(BusConf) * busCount_));
+	scratch_ = (float*)(mem + voiceBytes + opBytes + outBytes + laneBytes + instBytes + busBytes);
+	voiceOut_ = scratch_ + voiceScratch;
+	busMix_ = voiceOut_ + RENDER_BLOCK;
+	outputs_ = busMix_ + 2*RENDER_BLOCK*busCount_;
+	catchUp_ = outputs_ + 2*RENDER_BLOCK*outputCount_;
+	upIn_ = catchUp_ + RENDER_BLOCK;
+	upPhase_ = upIn_ + 2*RENDER_BLOCK;
+	upOut_ = upPhase_ + 2*RENDER_BLOCK;
+	effectScratch_ = upOut_ + 2*RENDER_BLOCK;
+	effectWet_ = effectScratch_ + EffectUnit::scratchFloats();
+	effectIn_ = effectWet_ + 2*RENDER_BLOCK;
+	adaptiveRate_ = true;
+	designUpsampler(rateFir2_, 2);
+	designUpsampler(rateFir4_, 4);
+	noteCache_.init(cacheBytes ? (uint8_t*)scratch_ + scratchBytes : nullptr, config.noteCacheBytes, config.noteCacheFrames);
+
+	uint8_t* effectMem = (uint8_t*)scratch_ + scratchBytes + cacheBytes;
+	effectConf_ = (EffectConf*)effectMem;
+	effects_ = (EffectUnit*)(effectMem + align_up(sizeof(EffectConf) * effectCount_));
+	effectUse_ = (EEffectUse*)((uint8_t*)effects_ + align_up(sizeof(EffectUnit) * effectCount_));
+	float* effectLines = (float*)((uint8_t*)effectUse_ + align_up(sizeof(EEffectUse) * effectCount_));
+	for(int i = 0; i < effectCount_; ++i) {
+		new (&effectConf_[i]) EffectConf();
+		new (&effects_[i]) EffectUnit();
+		effects_[i].init(effectLines + i*effectFloats, effectFloats);
+	}
+	renderMode_ = RenderBlock;
+	analyzer_ = nullptr;
+	tapBlock_ = nullptr;
+	tapNote_ = -1;
+	latency_ = nullptr;
+	framesRendered_ = 0;
+	eventHead_ = 0;
+	eventTail_ = 0;
+	masterGain_ = MASTER_GAIN;
+	limit_ = 1.f;
+	setKernels(KernelBest);
+
+	for(int i = 0; i < voiceCount_ * maxOps; ++i)
+		new (&ops[i]) Operator();
+
+	for(int i = 0; i < voiceCount_; ++i) {
+		new (&voices_[i]) Voice();
+		voices_[i].init(ops + i*maxOps, outs + i*maxOps, maxOps, laneState + i*laneFloats, maxLanes);
+	}
 
-	activeInstrument_ = new Instrument();
-	activeInstrument_->setAlgorithm(&dx7_1Algo);
+	for(int i = 0; i < maxInstrumentCount_; ++i) {
+		new (&instrumentList_[i]) Instrument();
+		instrumentList_[i].initPrograms(programs + i*programCount, programCount);
+		tuned_[i].serial = 0;
+		tuned_[i].freq = tunedFreq + i*TUNING_NOTES*maxOps;
+	}
 
-	// allocate memory for instrument list
-	maxInstrumentCount_ = 32; // arbitrary number, could be anything.
-	instrumentList_ = new Instrument*[maxInstrumentCount_];
-	instrumentCount_ = 0;
+	for(int i = 0; i < busCount_; ++i)
+		new (&busConf_[i]) BusConf();
+	for(int i = 0; i < MAX_CHANNELS; ++i)
+		channelBus_[i] = i % busCount_;
+
+	activeInstrument_ = &instrumentList_[0];
+	activeInstrument_->setAlgorithm(&dx7_1Algo);
+	instrumentCount_ = 1;
+	noteSerial_ = tuning_.copyTable(noteFreq_);
 }
 
 VulkFM::~VulkFM()
 {
-	for(int i = 0; i <poolCount_; ++i) {
-		delete voicePool_[i];
-	}
-	delete voicePool_;
-	voicePool_ = nullptr;
+	// Everything in the arena is trivially destructible.
+	arena_free(arena_);
+	arena_ = nullptr;
+	voices_ = nullptr;
+	instrumentList_ = nullptr;
+}
 
-	for(int i = 0; i <activeCount_; ++i) {
-		delete activeVoices_[i].voice_;
+bool VulkFM::setKernels(EKernelLevel level)
+{
+	const Kernels* k = ::getKernels(level);
+	if(k == nullptr)
+		return false;
+	kernels_ = k;
+
+	// A unison stack narrower than the vectors would run in the scalar tail,
+	// use the widest kernels that fit instead.
+	for(int lanes = 1; lanes <= MAX_UNISON; ++lanes) {
+		laneKernels_[lanes] = k;
+		for(int l = k->level; l >= KernelScalar; --l) {
+			const Kernels* lk = ::getKernels((EKernelLevel)l);
+			if(lk != nullptr && lk->width <= lanes) {
+				laneKernels_[lanes] = lk;
+				break;
+			}
+		}
 	}
-	delete activeVoices_;
-	activeVoices_ = nullptr;
+	laneKernels_[0] = k;
+	return true;
+}
+
+void VulkFM::setChannelBus(int channel, int bus)
+{
+	if(channel >= 0 && channel < MAX_CHANNELS && bus >= 0 && bus < busCount_)
+		channelBus_[channel] = bus;
 }
 
+int VulkFM::getInstrumentCount() { return instrumentCount_; }
+
+Instrument* VulkFM::getInstrumentList() { return instrumentList_; }
+
 
 void VulkFM::trigger(int8_t note, int8_t channel, int8_t velocity)
 {
-	int nextHead = (eventHead_ + 1) % MAX_EVENTS;
-	if (nextHead != eventTail_)
+	const uint16_t head = eventHead_.load(std::memory_order_relaxed);
+	const uint16_t nextHead = (head + 1) % MAX_EVENTS;
+	if (nextHead != eventTail_.load(std::memory_order_acquire))
 	{
-		int idx = eventHead_;
-		eventList_[idx].ch_ = channel;
-		eventList_[idx].note_ = note;
-		eventList_[idx].vel_ = velocity;
-		eventList_[idx].event_ = EEvent::Trigger;
-		eventHead_ = nextHead;
+		eventList_[head].ch_ = channel;
+		eventList_[head].note_ = note;
+		eventList_[head].vel_ = velocity;
+		eventList_[head].event_ = EEvent::Trigger;
+		eventList_[head].latencyId_ = latency_ != nullptr ? latency_->begin(note, getFramesRendered()) : -1;
+		eventHead_.store(nextHead, std::memory_order_release);
 	}
 }
 
-void VulkFM::release(int8_t note, int8_t /*channel*/, int8_t /*velocity*/)
+void VulkFM::release(int8_t note, int8_t channel, int8_t /*velocity*/)
 {
-	int nextHead = (eventHead_ + 1) % MAX_EVENTS;
-	if (nextHead != eventTail_)
+	const uint16_t head = eventHead_.load(std::memory_order_relaxed);
+	const uint16_t nextHead = (head + 1) % MAX_EVENTS;
+	if (nextHead != eventTail_.load(std::memory_order_acquire))
 	{
-		int idx = eventHead_;
-		eventList_[idx].note_ = note;
-		eventList_[idx].event_ = EEvent::Release;
-		eventHead_ = nextHead;
+		eventList_[head].ch_ = channel;
+		eventList_[head].note_ = note;
+		eventList_[head].event_ = EEvent::Release;
+		eventList_[head].latencyId_ = -1;
+		eventHead_.store(nextHead, std::memory_order_release);
 	}
 }
 
+void VulkFM::noteOn(int8_t note, int8_t channel, int8_t velocity)
+{
+	NoteEvent e;
+	e.note_ = note;
+	e.ch_ = channel;
+	e.vel_ = velocity;
+	e.event_ = EEvent::Trigger;
+	handleEvent(e);
+}
+
+void VulkFM::noteOff(int8_t note, int8_t channel)
+{
+	NoteEvent e;
+	e.note_ = note;
+	e.ch_ = channel;
+	e.event_ = EEvent::Release;
+	handleEvent(e);
+}
+
 
 void VulkFM::handleEvent(const struct VulkFM::NoteEvent& evnt)
 {
 	int8_t note = evnt.note_;
 	if (evnt.event_ == EEvent::Trigger)
 	{
+		if (latency_ != nullptr)
+			latency_->stamp(evnt.latencyId_, LatencyHandled, getFramesRendered());
+
 		Voice* voice = nullptr;
 
 		for (int i = 0; i < activeCount_; ++i) {
-			if (activeVoices_[i].note_ == note) {
-				voice = activeVoices_[i].voice_;
+			if (voices_[i].currentNote() == note && voices_[i].channel() == evnt.ch_) {
+				voice = &voices_[i];
 				break;
 			}
 		}
 
-		if (voice == nullptr) {
-			voice = getFromPool();
-		}
-
+		// Reduced rate voices have rendered ahead of the output, their
+		// envelopes take the lead into account.
 		if (voice != nullptr) {
-			if (!voice->isActive()) {
-
-				Instrument* inst = getInstrumentByChannel(evnt.ch_);
-				voice->trigger(note, inst);
-
-				ActiveVoice *voiceNotePair = &activeVoices_[activeCount_];
-				voiceNotePair->note_ = note;
-				voiceNotePair->voice_ = voice;
-				activeCount_++;
-			}
-			else {
-				voice->retrigger();
-			}
+			stopCaching(*voice);
+			voice->retrigger(evnt.vel_, voice->rate_.lead());
+			tapNote_ = note;
+			if (voice->latencyId_ >= 0)
+				latency_->abandon(voice->latencyId_);
+			voice->latencyId_ = evnt.latencyId_;
+		}
+		// Keys the tuning leaves out don't play.
+		else if (noteFreq_[note & (TUNING_NOTES-1)] > 0.f && (voice = getFromPool()) != nullptr) {
+			Instrument* inst = getInstrumentByChannel(evnt.ch_);
+			const TunedNotes& tuned = tunedNotes(*inst);
+			voice->trigger(note, evnt.vel_, inst, tuned.freq + (note & (TUNING_NOTES-1))*tuned.opCount, tuned.laneRatio);
+			voice->setBus(channelBus_[evnt.ch_ & (MAX_CHANNELS-1)]);
+			voice->setChannel(evnt.ch_);
+			voice->cached_ = CachedNote();
+			voice->latencyId_ = evnt.latencyId_;
+			tapNote_ = note;
+			if (!voice->isActive())
+				returnToPool(activeCount_-1);
+			else if (noteCache_.enabled() && renderMode_ == RenderBlock)
+				voice->cached_.mode = CachePending;
+		}
+		else if (latency_ != nullptr) {
+			latency_->abandon(evnt.latencyId_);
 		}
 	}
 	else if (evnt.event_ == EEvent::Release)
 	{
 		for (int i = 0; i < activeCount_; ++i) {
-			if (activeVoices_[i].note_ == note) {
-				activeVoices_[i].voice_->release();
+			if (voices_[i].currentNote() == note && voices_[i].channel() == evnt.ch_) {
+				stopCaching(voices_[i]);
+				voices_[i].release(voices_[i].rate_.lead());
 				break;
 			}
 		}
@@ -371,49 +1016,526 @@ void VulkFM::handleEvent(const struct VulkFM::NoteEvent& evnt)
 }
 
 
-void VulkFM::update(float dt)
+// A few compares per note-on while nothing changes, a rebuild is one multiply
+// per note and operator.
+const VulkFM::TunedNotes& VulkFM::tunedNotes(const Instrument& inst)
+{
+	const int idx = (int)(&inst - instrumentList_);
+	assert(idx >= 0 && idx < maxInstrumentCount_);
+	TunedNotes& t = tuned_[idx];
+
+	const uint32_t serial = noteSerial_;
+	const int ops = inst.program().operatorCount <= maxOps_ ? inst.program().operatorCount : 0;	// too big to play
+	const int lanes = inst.unison < 1 ? 1 : (inst.unison > maxLanes_ ? maxLanes_ : inst.unison);
+	bool stale = t.serial != serial || t.opCount != ops;
+	for(int i = 0; i < ops && !stale; ++i)
+		stale = t.freqScale[i] != inst.opConf_[i].freqScale;
+	if(!stale && t.lanes == lanes && t.unisonDetune == inst.unisonDetune)
+		return t;
+
+	t.serial = serial;
+	t.opCount = ops;
+	for(int i = 0; i < ops; ++i)
+		t.freqScale[i] = inst.opConf_[i].freqScale;
+	for(int n = 0; n < TUNING_NOTES; ++n) {
+		const float base = noteFreq_[n];
+		for(int i = 0; i < ops; ++i)
+			t.freq[n*ops + i] = base * t.freqScale[i];
+	}
+
+	// Copies spread evenly over the detune range.
+	t.lanes = lanes;
+	t.unisonDetune = inst.unisonDetune;
+	t.laneRatio[0] = 1.f;
+	for(int l = 0; l < lanes && lanes > 1; ++l) {
+		float pos = (float)l/(lanes-1) - 0.5f;
+		t.laneRatio[l] = powf(2.f, inst.unisonDetune*pos/1200.f);
+	}
+	return t;
+}
+
+
+void VulkFM::processEvents()
 {
-	while (eventHead_ != eventTail_)
+	// The control thread may be changing the tuning, work from a copy.
+	if(tuning_.serial() != noteSerial_)
+		noteSerial_ = tuning_.copyTable(noteFreq_);
+
+	const uint16_t head = eventHead_.load(std::memory_order_acquire);
+	uint16_t tail = eventTail_.load(std::memory_order_relaxed);
+	while (tail != head)
 	{
-		uint16_t idx = eventTail_;
-		handleEvent(eventList_[idx]);
-		eventTail_ = (eventTail_+1)%MAX_EVENTS;
+		handleEvent(eventList_[tail]);
+		tail = (tail+1)%MAX_EVENTS;
+		eventTail_.store(tail, std::memory_order_release);
 	}
+}
 
-	for(int i = 0; i < activeCount_; ++i) {
-		bool playing = activeVoices_[i].voice_->update(dt);
-		if(!playing) {
-			returnToPool(activeVoices_[i].voice_);
-			auto &tmp = activeVoices_[--activeCount_];
-			activeVoices_[i] = tmp;
-		}
+void VulkFM::update(float dt)
+{
+	processEvents();
+
+	for(int i = 0; i < activeCount_; ) {
+		bool playing = voices_[i].update(dt);
+		if(playing)
+			++i;
+		else
+			returnToPool(i);	// last voice moved here, update it next
 	}
 }
 
+// Mono, per sample. Pan is ignored, a voice plays at its average level.
 float VulkFM::evaluate()
 {
 	float sample = 0;
 	for(int i = 0; i < activeCount_; ++i) {
-		sample += activeVoices_[i].voice_->evaluate() * 0.7f;
+		sample += voices_[i].evaluate() * 0.5f*(voices_[i].gainLeft() + voices_[i].gainRight());
 	}
 
 	outBuffer_[outBufferIdx_++] = sample;
 	outBufferIdx_ =  outBufferIdx_ % 1024;
-	return sample*0.3f;
+	return sample*masterGain_;
+}
+
+void VulkFM::render(float* out, int frames, float dt)
+{
+	processEvents();
+
+	const Kernels& k = *kernels_;
+	while(frames > 0) {
+		int n = frames < RENDER_BLOCK ? frames : RENDER_BLOCK;
+		renderBlock(n, dt);
+		memset(out, 0, sizeof(float)*n);
+		k.addScaled(out, outputs_, 0.5f, n);
+		k.addScaled(out, outputs_ + RENDER_BLOCK, 0.5f, n);
+		out += n;
+		frames -= n;
+	}
+}
+
+void VulkFM::renderOutputs(float* const* outs, int frames, float dt)
+{
+	processEvents();
+
+	int done = 0;
+	while(done < frames) {
+		int n = frames - done < RENDER_BLOCK ? frames - done : RENDER_BLOCK;
+		renderBlock(n, dt);
+		for(int c = 0; c < 2*outputCount_; ++c) {
+			if(outs[c] != nullptr)
+				memcpy(outs[c] + done, outputs_ + c*RENDER_BLOCK, sizeof(float)*n);
+		}
+		done += n;
+	}
+}
+
+// Voices are panned into their bus, buses are summed into their output and
+// every output gets one gain and limit pass. Buses without voices are skipped.
+void VulkFM::renderBlock(int n, float dt)
+{
+	// Reference mode mixes with the scalar kernels as well, same result on any cpu.
+	const bool reference = renderMode_ == RenderReference;
+	const Kernels& k = reference ? *::getKernels(KernelScalar) : *kernels_;
+
+	for(int b = 0; b < busCount_; ++b)
+		busActive_[b] = false;
+
+	tapBlock_ = analyzer_ != nullptr ? analyzer_->beginWrite() : nullptr;
+	if(tapBlock_ != nullptr)
+		tapBlock_->opFrames = 0;
+
+	for(int i = 0; i < activeCount_; ) {
+		Voice& voice = voices_[i];
+		bool playing;
+		if(reference) {
+			stopCaching(voice);
+			playing = voice.renderSamples(voiceOut_, n, dt);
+		}
+		else if(voice.cached_.mode != CacheOff) {
+			playing = renderCached(voice, n, dt);
+		}
+		else {
+			playing = renderVoice(voice, voiceOut_, n, dt);
+		}
+
+		if(voice.latencyId_ >= 0) {
+			for(int s = 0; s < n; ++s) {
+				if(voiceOut_[s] != 0.f) {
+					latency_->stamp(voice.latencyId_, LatencyFirst, getFramesRendered() + s);
+					voice.latencyId_ = -1;
+					break;
+				}
+			}
+		}
+
+		const int bus = voice.bus();
+		float* left = busMix_ + bus*2*RENDER_BLOCK;
+		float* right = left + RENDER_BLOCK;
+		if(!busActive_[bus]) {
+			memset(left, 0, sizeof(float)*n);
+			memset(right, 0, sizeof(float)*n);
+			busActive_[bus] = true;
+		}
+		k.panAdd(left, right, voiceOut_, voice.gainLeft(), voice.gainRight(), n);
+
+		if(playing)
+			++i;
+		else
+			returnToPool(i);	// last voice moved here, render it next
+	}
+
+	renderInserts(n, dt, k);
+
+	for(int c = 0; c < 2*outputCount_; ++c)
+		memset(outputs_ + c*RENDER_BLOCK, 0, sizeof(float)*n);
+
+	for(int b = 0; b < busCount_; ++b) {
+		const BusConf& conf = busConf_[b];
+		if(!busActive_[b] || conf.output < 0 || conf.output >= outputCount_)
+			continue;
+		const float gainLeft = conf.gain * (conf.balance > 0.f ? 1.f - conf.balance : 1.f);
+		const float gainRight = conf.gain * (conf.balance < 0.f ? 1.f + conf.balance : 1.f);
+		float* out = outputs_ + conf.output*2*RENDER_BLOCK;
+		k.addScaled(out, busMix_ + b*2*RENDER_BLOCK, gainLeft, n);
+		k.addScaled(out + RENDER_BLOCK, busMix_ + b*2*RENDER_BLOCK + RENDER_BLOCK, gainRight, n);
+	}
+
+	renderSends(n, dt, k);
+
+	for(int i = 0; i < n; ++i) {
+		outBuffer_[outBufferIdx_++] = 0.5f*(outputs_[i] + outputs_[RENDER_BLOCK + i]);
+		outBufferIdx_ = outBufferIdx_ % 1024;
+	}
+
+	for(int c = 0; c < 2*outputCount_; ++c)
+		k.gainLimit(outputs_ + c*RENDER_BLOCK, masterGain_, limit_, n);
+
+	if(tapBlock_ != nullptr) {
+		tapBlock_->frames = n;
+		tapBlock_->dt = dt;
+		memcpy(tapBlock_->left, outputs_, sizeof(float)*n);
+		memcpy(tapBlock_->right, outputs_ + RENDER_BLOCK, sizeof(float)*n);
+		analyzer_->endWrite();
+		tapBlock_ = nullptr;
+	}
+
+	framesRendered_.store(getFramesRendered() + n, std::memory_order_relaxed);
+}
+
+// Inserts are processed in place on their bus, sends are summed into the
+// input of their unit. Buses with an effect stay active without voices so
+// delay and reverb tails ring out.
+void VulkFM::renderInserts(int n, float dt, const Kernels& k)
+{
+	for(int u = 0; u < effectCount_; ++u)
+		effectUse_[u] = EffectUnused;
+
+	for(int b = 0; b < busCount_; ++b) {
+		const BusConf& conf = busConf_[b];
+		if(conf.effect < 0 || conf.effect >= effectCount_ || effectConf_[conf.effect].type == EffectNone)
+			continue;
+
+		const int u = conf.effect;
+		float* left = busMix_ + b*2*RENDER_BLOCK;
+		float* right = left + RENDER_BLOCK;
+		if(conf.effectRouting == EffectSend) {
+			if(effectUse_[u] == EffectInserted)
+				continue;
+			float* in = effectIn_ + u*2*RENDER_BLOCK;
+			if(effectUse_[u] == EffectUnused) {
+				memset(in, 0, sizeof(float)*2*RENDER_BLOCK);
+				effectUse_[u] = EffectFed;
+			}
+			if(busActive_[b]) {
+				k.addScaled(in, left, conf.effectSend, n);
+				k.addScaled(in + RENDER_BLOCK, right, conf.effectSend, n);
+			}
+			continue;
+		}
+
+		if(effectUse_[u] != EffectUnused)
+			continue;		// one bus per insert
+		effectUse_[u] = EffectInserted;
+		if(!busActive_[b]) {
+			memset(left, 0, sizeof(float)*n);
+			memset(right, 0, sizeof(float)*n);
+			busActive_[b] = true;
+		}
+
+		const float mix = effectConf_[u].mix;
+		effects_[u].process(effectConf_[u], left, right, effectWet_, effectWet_ + RENDER_BLOCK, n, dt, k, effectScratch_);
+		k.scale(left, 1.f - mix, n);
+		k.addScaled(left, effectWet_, mix, n);
+		k.scale(right, 1.f - mix, n);
+		k.addScaled(right, effectWet_ + RENDER_BLOCK, mix, n);
+	}
+}
+
+// Send returns go to their output before the master gain.
+void VulkFM::renderSends(int n, float dt, const Kernels& k)
+{
+	for(int u = 0; u < effectCount_; ++u) {
+		const EffectConf& conf = effectConf_[u];
+		if(effectUse_[u] != EffectFed || conf.output < 0 || conf.output >= outputCount_)
+			continue;
+		float* in = effectIn_ + u*2*RENDER_BLOCK;
+		float* out = outputs_ + conf.output*2*RENDER_BLOCK;
+		effects_[u].process(conf, in, in + RENDER_BLOCK, effectWet_, effectWet_ + RENDER_BLOCK, n, dt, k, effectScratch_);
+		k.addScaled(out, effectWet_, conf.mix, n);
+		k.addScaled(out + RENDER_BLOCK, effectWet_ + RENDER_BLOCK, conf.mix, n);
+	}
+}
+
+// Operator outputs are still in scratch right after the voice rendered.
+void VulkFM::tapOperators(const Voice& voice, int frames, int rateFactor)
+{
+	AnalyzerBlock& b = *tapBlock_;
+	const float* outs = voice.blockOutputs(scratch_);
+	if(outs == nullptr || b.opFrames + frames > RENDER_BLOCK)
+		return;
+
+	const int count = voice.operatorCount() < ANALYZER_OPS ? voice.operatorCount() : ANALYZER_OPS;
+	for(int op = 0; op < count; ++op)
+		memcpy(b.ops[op] + b.opFrames, outs + op*RENDER_BLOCK, sizeof(float)*frames);
+	b.opFrames += frames;
+	b.note = voice.currentNote();
+	b.opCount = count;
+	b.rateFactor = rateFactor;
+}
+
+const Kernels& VulkFM::voiceKernels(Voice& voice) const
+{
+	return voice.lanes() > 1 ? *laneKernels_[voice.lanes()] : *kernels_;
+}
+
+static inline uint64_t fnv(uint64_t h, const void* data, size_t size)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	for(size_t i = 0; i < size; ++i)
+		h = (h ^ p[i]) * 0x100000001B3ull;
+	return h;
+}
+
+// Everything that decides the output of a voice before pan and level: the
+// compiled graph, operator settings, unison, tuning of the note, sample rate
+// and kernels. Velocity only scales the mix level so it is not part of the key.
+uint64_t VulkFM::noteKey(const Voice& voice, float dt) const
+{
+	const Instrument& inst = *voice.inst_;
+	const CompiledAlgorithm& prog = voice.program();
+	uint64_t h = 0xCBF29CE484222325ull;
+	const float freq = noteFreq_[voice.currentNote() & (TUNING_NOTES-1)];
+	h = fnv(h, &dt, sizeof(dt));
+	h = fnv(h, &freq, sizeof(freq));
+	h = fnv(h, &kernels_->level, sizeof(kernels_->level));
+	h = fnv(h, &adaptiveRate_, sizeof(adaptiveRate_));
+	h = fnv(h, &prog.operatorCount, sizeof(prog.operatorCount));
+	for(int i = 0; i < prog.operatorCount; ++i) {
+		const OpInstr& in = prog.instr[i];
+		const OperatorConf& conf = inst.opConf_[i];
+		h = fnv(h, &in.op, sizeof(in.op));
+		h = fnv(h, &in.output, sizeof(in.output));
+		h = fnv(h, &in.selfDepth, sizeof(in.selfDepth));
+		for(int m = 0; m < in.faninCount; ++m) {
+			h = fnv(h, &prog.fanin[in.faninStart + m].op, sizeof(uint8_t));
+			h = fnv(h, &prog.fanin[in.faninStart + m].depth, sizeof(float));
+		}
+		h = fnv(h, &conf.env, sizeof(EnvConf));
+		h = fnv(h, &conf.oscAmp, sizeof(conf.oscAmp));
+		h = fnv(h, &conf.freqScale, sizeof(conf.freqScale));
+		h = fnv(h, &conf.oscWaveform, sizeof(conf.oscWaveform));
+	}
+	h = fnv(h, &inst.unison, sizeof(inst.unison));
+	h = fnv(h, &inst.unisonDetune, sizeof(inst.unisonDetune));
+	h = fnv(h, &inst.unisonPhaseSpread, sizeof(inst.unisonPhaseSpread));
+	return h;
+}
+
+// Highest rate reduction that keeps the voice spectrum below half the internal
+// Nyquist frequency, which leaves room for the upsampler transition band and
+// for the sidebands Carson's rule leaves out.
+int VulkFM::pickRate(const Voice& voice, float dt) const
+{
+	if(!adaptiveRate_)
+		return 1;
+	const float top = voice.bandwidth();
+	for(int f = RATE_MAX_FACTOR; f > 1; f /= 2) {
+		if(top <= 0.25f / (dt*f))
+			return f;
+	}
+	return 1;
+}
+
+// Render n output frames of a voice at its own rate. Reduced rate voices are
+// upsampled with rateFir, frames past n are kept for the next call.
+bool VulkFM::renderVoice(Voice& voice, float* out, int n, float dt)
+{
+	VoiceRate& r = voice.rate_;
+	if(r.factor == 0)
+		r.factor = (int8_t)pickRate(voice, dt);
+
+	const Kernels& k = voiceKernels(voice);
+	const int f = r.factor;
+	const bool tap = tapBlock_ != nullptr && voice.currentNote() == tapNote_;
+	if(f == 1) {
+		bool playing = voice.renderBlock(out, n, dt, k, scratch_);
+		if(tap)
+			tapOperators(voice, n, 1);
+		return playing;
+	}
+
+	int done = r.pending < n ? r.pending : n;
+	memcpy(out, r.pendingOut, sizeof(float)*done);
+	r.pending -= done;
+	memmove(r.pendingOut, r.pendingOut + done, sizeof(float)*r.pending);
+	if(done == n)
+		return true;
+
+	// upIn_ holds RATE_TAPS-1 older samples then the new ones. The first block
+	// also renders the RATE_TAPS/2 samples the filter looks ahead.
+	const int need = n - done;
+	const int m = (need + f - 1) / f;
+	const int hist = RATE_TAPS-1;
+	bool playing;
+	if(r.primed) {
+		memcpy(upIn_, r.hist, sizeof(float)*hist);
+		playing = voice.renderBlock(upIn_ + hist, m, dt*f, k, scratch_);
+		if(tap)
+			tapOperators(voice, m, f);
+	}
+	else {
+		memset(upIn_, 0, sizeof(float)*(hist - RATE_TAPS/2));
+		playing = voice.renderBlock(upIn_ + hist - RATE_TAPS/2, m + RATE_TAPS/2, dt*f, k, scratch_);
+		if(tap)
+			tapOperators(voice, m + RATE_TAPS/2, f);
+		r.primed = true;
+		r.dt = dt;
+	}
+	memcpy(r.hist, upIn_ + m, sizeof(float)*hist);
+
+	const float* fir = f == 2 ? rateFir2_ : rateFir4_;
+	const int stride = RENDER_BLOCK/f + 1;
+	for(int p = 0; p < f; ++p)
+		k.fir(upPhase_ + p*stride, upIn_ + hist, fir + p*RATE_TAPS, RATE_TAPS, m);
+	for(int i = 0; i < m; ++i) {
+		for(int p = 0; p < f; ++p)
+			upOut_[i*f + p] = upPhase_[p*stride + i];
+	}
+
+	memcpy(out + done, upOut_, sizeof(float)*need);
+	r.pending = (int8_t)(m*f - need);
+	memcpy(r.pendingOut, upOut_ + need, sizeof(float)*r.pending);
+	return playing;
+}
+
+// Play a voice from the note cache, or record it while rendering live. The
+// cache is looked up on the first block, after that a changed patch sends the
+// voice back to live synthesis.
+bool VulkFM::renderCached(Voice& voice, int n, float dt)
+{
+	CachedNote& c = voice.cached_;
+	if(c.mode == CachePending) {
+		if(voice.rate_.factor == 0)
+			voice.rate_.factor = (int8_t)pickRate(voice, dt);
+		c.key = noteKey(voice, dt);
+		c.dt = dt;
+		c.pos = 0;
+		if((c.entry = noteCache_.find(c.key, voice.currentNote())) >= 0)
+			c.mode = CachePlaying;
+		else if((c.entry = noteCache_.record(c.key, voice.currentNote(), voice.stateSize())) >= 0)
+			c.mode = CacheRecording;
+		else
+			c.mode = CacheOff;
+	}
+	else if(noteKey(voice, dt) != c.key) {
+		noteCache_.stats().divergences++;
+		stopCaching(voice);
+	}
+
+	if(c.mode == CachePlaying) {
+		int done = noteCache_.read(c.entry, c.pos, voiceOut_, n);
+		c.pos += done;
+		if(done == n)
+			return true;
+		stopCaching(voice);
+		return renderVoice(voice, voiceOut_ + done, n - done, dt);
+	}
+
+	// Recording, split at record boundaries to store the state there.
+	int done = 0;
+	while(done < n && c.mode == CacheRecording) {
+		if(c.pos % NOTE_CACHE_RECORD == 0) {
+			float* state = noteCache_.addState(c.entry);
+			if(state == nullptr) {
+				stopCaching(voice);
+				break;
+			}
+			voice.saveState(state);
+		}
+
+		int run = NOTE_CACHE_RECORD - c.pos % NOTE_CACHE_RECORD;
+		if(run > n - done)
+			run = n - done;
+		bool playing = renderVoice(voice, voiceOut_ + done, run, dt);
+		noteCache_.addSamples(c.entry, voiceOut_ + done, run);
+		c.pos += run;
+		done += run;
+		if(!playing) {
+			stopCaching(voice);
+			memset(voiceOut_ + done, 0, sizeof(float)*(n - done));
+			return false;
+		}
+	}
+
+	if(done < n)
+		return renderVoice(voice, voiceOut_ + done, n - done, dt);
+	return true;
+}
+
+// A recording ends at the current position, a voice playing from the cache
+// loads the state of the record it is in and renders up to its position.
+void VulkFM::stopCaching(Voice& voice)
+{
+	CachedNote& c = voice.cached_;
+	if(c.mode == CacheRecording) {
+		noteCache_.finish(c.entry);
+	}
+	else if(c.mode == CachePlaying) {
+		int start;
+		voice.loadState(noteCache_.state(c.entry, c.pos, &start));
+		if(c.pos > start) {
+			// Catch-up frames were already heard from the recording, keep
+			// them out of the analyzer block.
+			AnalyzerBlock* tap = tapBlock_;
+			tapBlock_ = nullptr;
+			renderVoice(voice, catchUp_, c.pos - start, c.dt);
+			tapBlock_ = tap;
+		}
+		noteCache_.unpin(c.entry);
+	}
+	c.mode = CacheOff;
+	c.entry = -1;
 }
 
 Voice* VulkFM::getFromPool()
 {
-	Voice* inst = nullptr;
-	if(poolCount_ > 0) {
-		inst = voicePool_[--poolCount_];
+	Voice* voice = nullptr;
+	if(activeCount_ < voiceCount_) {
+		voice = &voices_[activeCount_++];
 	}
-	return inst;
+	return voice;
 }
 
-void VulkFM::returnToPool(Voice* inst)
+// Move the last active voice into the freed slot so the active range stays packed.
+void VulkFM::returnToPool(int activeIdx)
 {
-	voicePool_[poolCount_++] = inst;
+	stopCaching(voices_[activeIdx]);
+	if(voices_[activeIdx].latencyId_ >= 0)
+		latency_->abandon(voices_[activeIdx].latencyId_);
+	voices_[activeIdx].releaseProgram();
+	int last = --activeCount_;
+	if(activeIdx != last)
+		voices_[activeIdx].copyFrom(voices_[last]);
 }
 
 
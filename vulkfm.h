@@ -2,9 +2,26 @@
 #define VULKFM_H_
 
 #include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include "opgraph.h"
+#include "kernels.h"
+#include "notecache.h"
+#include "effects.h"
+#include "tuning.h"
+
+class Analyzer;
+struct AnalyzerBlock;
+class LatencyProbe;
 
 #define OP_COUNT 6
 #define MAX_EVENTS 16
+#define RENDER_BLOCK 128		// max samples per voice block
+#define MAX_UNISON 16
+#define MAX_CHANNELS 16			// midi channels
+#define MAX_OUTPUTS 16			// stereo output buses
+#define RATE_MAX_FACTOR 4		// voices render at 1, 1/2 or 1/4 of the output rate
+#define RATE_TAPS 8				// upsampler taps per output phase
 #define ACONST 	1.059463094359f
 
 
@@ -36,6 +53,7 @@ struct OperatorConf
 	uint8_t modulators = 0; 		// Bit mask for what operator out to use for modulation of this one.
 };
 
+// Classic DX style algorithm with up to OP_COUNT operators, see OpGraph for more.
 struct Algorithm
 {
 	int8_t operatorCount;    //
@@ -44,15 +62,47 @@ struct Algorithm
 };
 
 
+// A compiled patch. It is not written while a sounding note plays it, so
+// voices point at it instead of keeping a copy.
+struct InstrumentProgram
+{
+	CompiledAlgorithm compiled;
+	int voices = 0;			// sounding notes that play it
+};
+
 struct Instrument
 {
-	void setAlgorithm(const Algorithm* _algo) { algo_ = _algo; }
-	const Algorithm*  algo_;
-	OperatorConf opConf_[OP_COUNT];
+	// Both compile into a program no sounding note plays. They fail when the
+	// graph is bad or every program of the pool is still playing, the current
+	// one stays then. Call them on the render thread.
+	bool setAlgorithm(const Algorithm* _algo);
+	bool setGraph(const OpGraph& graph);	// clears algo_
+	void initPrograms(InstrumentProgram* pool, int count);
+	const CompiledAlgorithm& program() const	{ return program_->compiled; }
+	const Algorithm*  algo_ = nullptr;
+	InstrumentProgram* program_ = nullptr;	// evaluation order for new notes
+	InstrumentProgram* programs_ = nullptr;	// pool in the VulkFM arena
+	int programCount_ = 0;
+	OperatorConf opConf_[MAX_OPERATORS];
+
+	// Unison, every note plays this many detuned copies of the operator stack
+	// inside one voice. Detune is the total spread in cents, phase spread 0..1
+	// offsets the start phase of the copies by up to a full cycle.
+	int unison = 1;
+	float unisonDetune = 0.f;
+	float unisonPhaseSpread = 0.f;
+
+	// Voice level and pan (-1 left .. 1 right). velocitySens 0 plays every
+	// note at full level, 1 scales the level with velocity.
+	float gain = 1.f;
+	float pan = 0.f;
+	float velocitySens = 0.f;
+
 	int serialize(uint8_t* buffer, int maxSize) const;
 };
 
 extern Algorithm defaultAlgorithm;
+extern Algorithm dx7_1Algo;
 
 
 
@@ -61,12 +111,19 @@ class Env
 public:
 	Env();
 	void trigger(const EnvConf* _envConf);
-	void retrigger();
-	void release();
+	void retrigger(float lead = 0.f);
+	void release(float lead = 0.f);
 	bool update(float dt);
 	float evaluate() const;
+	int state() const { return state_; }
+	void setState(float level, int state) { level_ = level; state_ = (int8_t)state; }
+
+	// Level before each of n updates. Returns the last update result.
+	bool render(float* level, int n, float dt);
 
 protected:
+	void rewind(float time);
+
 	const EnvConf* envConf_;
 
 	float level_;
@@ -81,6 +138,13 @@ public:
 	void trigger(float _freq, const OperatorConf *opCont);
 	void update(float time);
 	float evaluate(float fmodulation) const;
+	float evaluateAt(float phase, float fmodulation) const;
+	float frequency() const { return freq_; }
+	float phase() const { return phase_; }
+	void setPhase(float phase) { phase_ = phase; }
+
+	// Phase before each of n updates, same as n calls to update(time).
+	void renderPhase(float* phase, int n, float time);
 
 protected:
 	const OperatorConf* opConf_;
@@ -94,52 +158,177 @@ class Operator
 public:
 	Operator();
 
+	// freq is the operator's own, freqScale applied.
 	void trigger(float freq, const OperatorConf *opConf);
-	void retrigger();
-	void release();
+	// lead is how far the voice has rendered past the event, in seconds.
+	void retrigger(float lead = 0.f);
+	void release(float lead = 0.f);
 
 	bool update(float deltaTime);
 	float evaluate(float modulation) const;
+	float evaluateAt(float phase, float modulation) const;	// for unison copies
+	float frequency() const { return osc_.frequency(); }
+
+	// Block versions of update, the kernels do the evaluate part.
+	void renderPhase(float* phase, int n, float deltaTime) { osc_.renderPhase(phase, n, deltaTime); }
+	bool renderEnv(float* level, int n, float deltaTime) { return env_.render(level, n, deltaTime); }
+	const OperatorConf* conf() const { return conf_; }
+
+	// Phase and envelope, 3 floats. Everything else is set by trigger.
+	void saveState(float* s) const;
+	void loadState(const float* s);
 
 protected:
+	const OperatorConf* conf_;
 	Osc osc_;
 	Env env_;
 };
 
 
-class Voice
+// Upsampler state of a voice rendering below the output rate. The voice runs
+// RATE_TAPS/2 internal samples ahead so notes start on time.
+struct VoiceRate
+{
+	int8_t factor = 0;			// 0 until picked on the first block
+	int8_t pending = 0;			// upsampled frames left over from the last block
+	bool primed = false;
+	float dt = 0;				// output sample time
+	float hist[RATE_TAPS-1];
+	float pendingOut[RATE_MAX_FACTOR-1];
+
+	// How far the voice has rendered past the output, in seconds.
+	float lead() const { return primed ? dt * (RATE_TAPS/2*factor + pending) : 0.f; }
+};
+
+#define RATE_STATE_FLOATS ((int)((sizeof(VoiceRate) + sizeof(float)-1) / sizeof(float)))
+
+// Runtime state lives in the VulkFM arena, a voice owns a fixed slice of
+// operators there and is cache line aligned so voices never share a line.
+class alignas(64) Voice
 {
 public:
 	Voice();
-	void trigger(int note, const Instrument* instrument);
-	void retrigger();
-	void release();
+	void init(Operator* ops, float* outs, int maxOps, float* laneState, int maxLanes);
+	void copyFrom(const Voice& other);
+	// opFreq holds the frequency of every operator for the note, laneRatio
+	// the detune of every unison copy, see VulkFM::tunedNotes.
+	void trigger(int note, int velocity, const Instrument* instrument, const float* opFreq, const float* laneRatio);
+	void retrigger(int velocity, float lead = 0.f);
+	void release(float lead = 0.f);
 	float evaluate();
 	bool update(float dt);
+
+	// Render n <= RENDER_BLOCK samples to out. scratch must hold
+	// voiceScratchSize() floats. Returns false when done.
+	bool renderBlock(float* out, int n, float dt, const Kernels& k, float* scratch);
+	static int voiceScratchSize(int maxOps, int maxLanes) { return RENDER_BLOCK * (2 + maxLanes*(1 + maxOps)); }
+
+	// Highest frequency in the output, Carson's rule through the operator graph.
+	// INFINITY when it can't be bounded.
+	float bandwidth() const;
+
+	// Same through per sample evaluate()/update().
+	bool renderSamples(float* out, int n, float dt);
+
+	// Running state for the note cache, stateSize() floats. Loading it into a
+	// voice triggered with the same note and patch continues from that point.
+	int stateSize() const { return opCount_ * (4 + (lanes_ > 1 ? 2*lanes_ : 0)) + (rate_.factor > 1 ? RATE_STATE_FLOATS : 0); }
+	void saveState(float* s) const;
+	void loadState(const float* s);
+
 	bool isActive()		{ return active_; }
-	int currentNote()	{ return note_; }
+	int lanes()			{ return lanes_; }
+	int operatorCount() const	{ return opCount_; }
+	// Taken at trigger, a patch change doesn't reach sounding notes.
+	const CompiledAlgorithm& program() const	{ return prog_->compiled; }
+	void releaseProgram();
+
+	// Per operator outputs of the last renderBlock, RENDER_BLOCK apart in
+	// scratch. nullptr when that block went through unison lanes or per sample.
+	const float* blockOutputs(const float* scratch) const;
+	int currentNote() const	{ return note_; }
+
+	// Mixer routing, gains include level, velocity and pan.
+	void setBus(int bus)	{ bus_ = bus; }
+	int bus() const			{ return bus_; }
+	void setChannel(int channel)	{ channel_ = (int8_t)channel; }
+	int channel() const		{ return channel_; }
+	float gainLeft() const	{ return gainLeft_; }
+	float gainRight() const	{ return gainRight_; }
 
 	const Instrument *inst_;
+	CachedNote cached_;
+	VoiceRate rate_;
+	int latencyId_ = -1;		// note-on waiting for its first sample
 
 protected:
+	InstrumentProgram* prog_;	// counted while the voice is in the active range
 	int opCount_;
+	int maxOps_;
 	int note_;
 	bool active_;
 
-	Operator ops_[OP_COUNT];
+	Operator* ops_;
+	float* outs_;
+
+	int bus_;
+	int8_t channel_;		// a note is released on the channel it was played on
+	float gainLeft_;
+	float gainRight_;
+	void setLevel(int velocity);
+
+	bool renderLanes(float* out, int n, float dt, const Kernels& k, float* scratch);
+
+	// Unison copies, only used when lanes_ > 1. Per operator and lane,
+	// [op*lanes_ + lane], the phase and the last output.
+	int lanes_;
+	int maxLanes_;
+	float laneGain_;
+	float* lanePhase_;
+	float* laneOut_;
+	float laneRatio_[MAX_UNISON];
+};
+
+
+struct VulkFMConfig
+{
+	int polyphony = 32;
+	int maxOperators = MAX_OPERATORS;	// per voice, patches with more are not played
+	int maxInstruments = 32;
+	int maxUnison = MAX_UNISON;			// unison copies per voice
+	int buses = MAX_CHANNELS;			// mix buses, channel n plays on bus n by default
+	int outputs = 1;					// stereo outputs, up to MAX_OUTPUTS
+	size_t noteCacheBytes = 0;			// note render cache budget, 0 disables it
+	int noteCacheFrames = 1<<16;		// longest recording per note
+	int effects = 2;					// effect units, see effects.h
+	int instrumentPrograms = 4;			// compiled patches per instrument, old ones stay while notes play them
+	float effectMaxRate = 48000.f;		// effect delay memory is sized for this rate
+};
+
+// Mix bus settings. Voices are summed into their bus, buses are summed into
+// their output with gain and balance (-1 left .. 1 right). A bus can run an
+// effect unit as an insert or feed it as a send.
+struct BusConf
+{
+	float gain = 1.f;
+	float balance = 0.f;
+	int output = 0;
+	int effect = -1;						// unit, -1 for none
+	EEffectRouting effectRouting = EffectInsert;
+	float effectSend = 1.f;					// send level
+};
+
 
-	float outs_[OP_COUNT];
+enum ERenderMode
+{
+	RenderBlock,		// block rendering with the selected kernels
+	RenderReference,	// per sample evaluate()/update() with libm sinf, deterministic
 };
 
 
 class VulkFM
 {
 protected:
-	struct ActiveVoice {
-		int note_;
-		Voice* voice_;
-	};
-
 	enum EEvent {
 		None,
 		Trigger,
@@ -151,55 +340,203 @@ protected:
 		int8_t ch_ = 0;
 		int8_t vel_ = 0;
 		EEvent event_ = EEvent::None;
+		int latencyId_ = -1;
 	};
 
 
 public:
-	VulkFM();
+	VulkFM(const VulkFMConfig& config = VulkFMConfig());
+	VulkFM(const VulkFM&) = delete;
+	VulkFM& operator=(const VulkFM&) = delete;
 
 	virtual ~VulkFM();
 
 	void update(float dt);
 	float evaluate();
 
+	// Render a run of mono samples in the current mode, output 0 mixed down.
+	// Queued events are applied first so they are heard from out[0].
+	void render(float* out, int frames, float dt);
+
+	// Same for all stereo outputs. outs holds a left and a right pointer per
+	// output, 2*getOutputCount() in total. nullptr entries are skipped.
+	void renderOutputs(float* const* outs, int frames, float dt);
+
+	int getBusCount() const		{ return busCount_; }
+	int getOutputCount() const	{ return outputCount_; }
+	BusConf* getBus(int bus)	{ return &busConf_[bus]; }
+
+	// Effect units, an insert runs on the first bus using it, a send on the sum
+	// of all buses feeding it. Changing the type clears the unit's delay memory.
+	int getEffectCount() const		{ return effectCount_; }
+	EffectConf* getEffect(int unit)	{ return &effectConf_[unit]; }
+	void setChannelBus(int channel, int bus);
+
+	const NoteCacheStats& getNoteCacheStats() const { return noteCache_.stats(); }
+
+	// Copy every rendered block, and the operator outputs of the most recently
+	// triggered voice, to an analyzer. Set it before audio starts, nullptr to stop.
+	void setAnalyzer(Analyzer* analyzer) { analyzer_ = analyzer; }
+
+	// Stamp every trigger() on its way to the output. Set before audio starts.
+	void setLatencyProbe(LatencyProbe* probe) { latency_ = probe; }
+
+	// Output frames rendered so far, what LatencyProbe frame stamps count.
+	uint64_t getFramesRendered() const { return framesRendered_.load(std::memory_order_relaxed); }
+
+	// Applied to every output after mixing, then clamped to +-limit.
+	void setMasterGain(float gain, float limit = 1.f) { masterGain_ = gain; limit_ = limit; }
+
+	void setRenderMode(ERenderMode mode) { renderMode_ = mode; }
+
+	// Render voices whose spectrum allows it at 1/2 or 1/4 rate, on by default.
+	// Picked per voice on its first block.
+	void setAdaptiveRate(bool on) { adaptiveRate_ = on; }
+	bool getAdaptiveRate() const { return adaptiveRate_; }
+	ERenderMode getRenderMode() const { return renderMode_; }
+
+	// Pick kernels for an instruction set, false if this cpu can't run them.
+	bool setKernels(EKernelLevel level);
+	const Kernels* getKernels() const { return kernels_; }
+
+	// Apply queued trigger/release events, update() does this as well.
+	void processEvents();
+
 	void trigger(int8_t note, int8_t channel, int8_t velocity);
 	void release(int8_t note, int8_t channel, int8_t velocity);
 
+	// Render thread only, applied right away without the event queue. For a
+	// sequencer running in the audio callback while another thread plays
+	// through trigger(). Not seen by the latency probe.
+	void noteOn(int8_t note, int8_t channel, int8_t velocity);
+	void noteOff(int8_t note, int8_t channel);
+
 	int activeVoices() { return activeCount_; }
 
 	float* getOutBuffer() { return outBuffer_; }
 
 	Instrument* getInstrument(int /*idx*/) { return activeInstrument_; }
 
+	// Note frequencies, 432 Hz on note 57 by default. Changes apply from the
+	// next note-on.
+	Tuning* getTuning() { return &tuning_; }
+
 
 	int getInstrumentCount();
 	Instrument* getInstrumentList();
 
 protected:
+	void renderBlock(int n, float dt);		// to outputs_
+	void renderInserts(int n, float dt, const Kernels& k);
+	void renderSends(int n, float dt, const Kernels& k);
+	const Kernels& voiceKernels(Voice& voice) const;
+	bool renderVoice(Voice& voice, float* out, int n, float dt);
+	int pickRate(const Voice& voice, float dt) const;
+	bool renderCached(Voice& voice, int n, float dt);
+	uint64_t noteKey(const Voice& voice, float dt) const;
+	void stopCaching(Voice& voice);		// back to live synthesis at the current position
+	void tapOperators(const Voice& voice, int frames, int rateFactor);
+
 	Voice* getFromPool();
-	void returnToPool(Voice*);
+	void returnToPool(int activeIdx);
 
 	void handleEvent(const struct NoteEvent&);
+
+	// Operator frequencies of every note and unison detune of an instrument,
+	// rebuilt on note-on when the tuning, freqScale or unison settings have
+	// changed since.
+	struct TunedNotes {
+		uint32_t serial;			// of the tuning, 0 before the first build
+		int opCount;
+		int lanes;
+		float unisonDetune;
+		float freqScale[MAX_OPERATORS];
+		float laneRatio[MAX_UNISON];
+		float* freq;				// [note*opCount + op]
+	};
+	const TunedNotes& tunedNotes(const Instrument& inst);
 	Instrument* getInstrumentByChannel(int /*channel*/) { return activeInstrument_; }
 
 protected:
 	Instrument* activeInstrument_;
 
+	// Single producer, single consumer: trigger() and release() from one
+	// thread, which may be another than rendering. Anything on the render
+	// thread uses noteOn()/noteOff() instead.
 	struct NoteEvent eventList_[MAX_EVENTS];
-	uint16_t eventHead_ = 0;
-	uint16_t eventTail_ = 0;
-
-	Instrument** instrumentList_;
+	std::atomic<uint16_t> eventHead_;
+	std::atomic<uint16_t> eventTail_;
+
+	// All runtime state in one allocation made at construction, nothing is
+	// allocated after that. Layout: voices, operators, operator outs,
+	// unison lanes, instruments and their note frequencies, bus settings,
+	// render scratch, bus and output buffers, note cache, effect units and
+	// their delay memory.
+	void* arena_;
+	size_t arenaSize_;
+
+	ERenderMode renderMode_;
+	const Kernels* kernels_;
+	const Kernels* laneKernels_[MAX_UNISON+1];	// widest kernels not wider than lane count
+	float* scratch_;		// voice render scratch
+	float* voiceOut_;		// one voice block
+
+	// Mixer, every bus and output is a left and a right RENDER_BLOCK buffer.
+	int busCount_;
+	int outputCount_;
+	BusConf* busConf_;
+	float* busMix_;			// [bus*2 + side]
+	float* outputs_;		// [output*2 + side]
+	bool* busActive_;		// bus has voices this block
+	int channelBus_[MAX_CHANNELS];
+	float masterGain_;
+	float limit_;
+
+	// Effect units and per block use, effectIn_ sums the sends of each unit.
+	enum EEffectUse : int8_t { EffectUnused, EffectInserted, EffectFed };
+	int effectCount_;
+	EffectConf* effectConf_;
+	EffectUnit* effects_;
+	EEffectUse* effectUse_;
+	float* effectIn_;			// [unit*2 + side]
+	float* effectWet_;			// left and right
+	float* effectScratch_;
+
+	// Adaptive rate, upsampler phases for factor 2 and 4 and work buffers.
+	bool adaptiveRate_;
+	float rateFir2_[2*RATE_TAPS];
+	float rateFir4_[4*RATE_TAPS];
+	float* upIn_;
+	float* upPhase_;
+	float* upOut_;
+
+	// Recorded note attacks, voices are checked against it on their first block.
+	NoteCache noteCache_;
+	float* catchUp_;		// scratch block for getting back to live synthesis
+
+	Instrument* instrumentList_;
 	int instrumentCount_;
 	int maxInstrumentCount_;
+	int maxOps_;
+	int maxLanes_;
 
-	Voice** voicePool_;
-	int poolCount_;
+	Tuning tuning_;
+	float noteFreq_[TUNING_NOTES];	// render thread copy of the tuning
+	uint32_t noteSerial_;
+	TunedNotes* tuned_;			// per instrument
 
-	ActiveVoice* activeVoices_;
+	// Active voices are kept packed at the front, voices_[0..activeCount_).
+	Voice* voices_;
 	int activeCount_;
+	int voiceCount_;
+
+	// Analysis tap, the block being filled this renderBlock or nullptr.
+	Analyzer* analyzer_;
+	AnalyzerBlock* tapBlock_;
+	int tapNote_;
 
-	int voices_;
+	LatencyProbe* latency_;
+	std::atomic<uint64_t> framesRendered_;
 
 	float outBuffer_[1024]; // Used for visualization, nothing else
 	int outBufferIdx_;
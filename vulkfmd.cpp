@@ -0,0 +1,89 @@
+// Render daemon, one engine shared by local hosts. See server.h for the
+// protocol, render -d plays a MIDI file through it.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include "server.h"
+
+static RenderServer server;
+
+static void on_signal(int)
+{
+	server.stop();
+}
+
+static void usage()
+{
+	printf("usage: vulkfmd [-t] [-k level] [-r rate] [-b frames] [-p voices] [-m MB] [socket]\n");
+	printf("  -t         real time, render on a clock and drop blocks for full rings\n");
+	printf("  -k level   kernels to use: scalar, sse2, avx2, avx512, default best\n");
+	printf("  -r rate    sample rate, default 44100\n");
+	printf("  -b frames  block size, default 256\n");
+	printf("  -p voices  polyphony shared by all clients, default 64\n");
+	printf("  -m MB      note render cache size, default off\n");
+	printf("  socket     default $XDG_RUNTIME_DIR/vulkfm.sock or /tmp/vulkfm-uid/vulkfm.sock\n");
+}
+
+int main(int argc, char* argv[])
+{
+	ServerConfig config;
+	config.engine.polyphony = 64;
+	EKernelLevel kernelLevel = KernelBest;
+
+	int argi = 1;
+	for(; argi < argc && argv[argi][0] == '-'; ++argi) {
+		if(argv[argi][1] == 't') { config.realTime = true; continue; }
+		if(argi+1 >= argc) { usage(); return 1; }
+		switch(argv[argi][1]) {
+		case 'r': config.rate = atoi(argv[++argi]); break;
+		case 'b': config.blockFrames = atoi(argv[++argi]); break;
+		case 'p': config.engine.polyphony = atoi(argv[++argi]); break;
+		case 'm': config.engine.noteCacheBytes = (size_t)atoi(argv[++argi]) << 20; break;
+		case 'k':
+			++argi;
+			for(int i = 0; i < KernelLevelCount; ++i) {
+				if(strcmp(argv[argi], kernelLevelName((EKernelLevel)i)) == 0)
+					kernelLevel = (EKernelLevel)i;
+			}
+			break;
+		default: usage(); return 1;
+		}
+	}
+	if(config.rate <= 0 || config.blockFrames <= 0 || config.engine.polyphony <= 0 || argi + 1 < argc) {
+		usage();
+		return 1;
+	}
+
+	char path[108];
+	if(argi < argc) {
+		snprintf(path, sizeof(path), "%s", argv[argi]);
+	}
+	else if(!serverSocketPath(path, sizeof(path))) {
+		perror("no private socket directory");
+		return 1;
+	}
+
+	if(!server.open(path, config)) {
+		perror(path);
+		return 1;
+	}
+	if(!server.engine()->setKernels(kernelLevel)) {
+		printf("kernels %s not supported on this cpu\n", kernelLevelName(kernelLevel));
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	printf("vulkfmd on %s, %d Hz, %d frame blocks, %s kernels%s\n", path, config.rate, config.blockFrames,
+		server.engine()->getKernels()->name, config.realTime ? ", real time" : "");
+	fflush(stdout);
+	server.run();
+	server.close();
+	return 0;
+}